@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Generate a synthetic header, and a source file that uses part of
+it, for benchmarking .npch imports.
+
+The header has chains of structs nested DEPTH deep, the head of each
+chain pointing at the previous one; enums; prototypes taking them; and
+function-like macros.  The source includes the header, or imports it
+with --import, and calls the first USAGE fraction of the prototypes,
+so that the cost of a lazy import can be seen as a function of how
+much of it is used.
+"""
+
+import argparse
+import sys
+
+
+def generate_header(out, structs, prototypes, enums, depth, macros):
+    out.write('/* Generated by gen_header.py.  */\n\n')
+    out.write('#ifndef BENCH_GENERATED_H\n#define BENCH_GENERATED_H\n\n')
+
+    for e in range(enums):
+        out.write('enum bench_enum_%d\n{\n' % e)
+        for i in range(8):
+            out.write('  BENCH_E%d_%d = %d,\n' % (e, i, i * (e + 1)))
+        out.write('};\n\n')
+
+    for s in range(structs):
+        out.write('struct bench_struct_%d\n{\n' % s)
+        out.write('  int id;\n')
+        out.write('  unsigned int flags : 3;\n')
+        if enums:
+            out.write('  enum bench_enum_%d kind;\n' % (s % enums))
+        # Every DEPTH structs start a new chain, whose head points at
+        # the previous chain instead of containing it.
+        if s % depth != 0:
+            out.write('  struct bench_struct_%d inner;\n' % (s - 1))
+        elif s != 0:
+            out.write('  struct bench_struct_%d *prev;\n' % (s - 1))
+        out.write('  const char *name;\n')
+        out.write('  double values[4];\n')
+        out.write('};\n\n')
+        out.write('typedef struct bench_struct_%d bench_t%d;\n\n' % (s, s))
+
+    for p in range(prototypes):
+        s = p % structs if structs else None
+        if s is None:
+            out.write('extern int bench_fn_%d (int);\n' % p)
+        elif enums:
+            out.write('extern int bench_fn_%d (bench_t%d *, enum '
+                      'bench_enum_%d);\n' % (p, s, p % enums))
+        else:
+            out.write('extern int bench_fn_%d (bench_t%d *);\n' % (p, s))
+    out.write('\n')
+
+    for m in range(macros):
+        out.write('#define BENCH_MACRO_%d(x) ((x) + %d)\n' % (m, m))
+
+    out.write('\n#endif\n')
+
+
+def generate_source(out, header, use_import, structs, prototypes, enums,
+                    macros, usage):
+    if use_import:
+        out.write('#pragma GCC import_pch "%s"\n\n' % header)
+    else:
+        out.write('#include "%s"\n\n' % header)
+
+    used = int(round(prototypes * usage))
+    out.write('int\nbench_main (void)\n{\n  int total = 0;\n')
+    for p in range(used):
+        if macros:
+            out.write('  total = BENCH_MACRO_%d (total);\n' % (p % macros))
+        if not structs:
+            out.write('  total += bench_fn_%d (%d);\n' % (p, p))
+            continue
+        s = p % structs
+        out.write('  {\n    bench_t%d v;\n    v.id = %d;\n' % (s, p))
+        if enums:
+            out.write('    total += bench_fn_%d (&v, BENCH_E%d_1);\n'
+                      % (p, p % enums))
+        else:
+            out.write('    total += bench_fn_%d (&v);\n' % p)
+        out.write('  }\n')
+    out.write('  return total;\n}\n')
+
+
+def positive(text):
+    value = int(text)
+    if value < 1:
+        raise argparse.ArgumentTypeError('%s is not positive' % text)
+    return value
+
+
+def fraction(text):
+    value = float(text)
+    if not 0 <= value <= 1:
+        raise argparse.ArgumentTypeError('%s is not in [0, 1]' % text)
+    return value
+
+
+def add_arguments(parser):
+    parser.add_argument('--structs', type=int, default=200)
+    parser.add_argument('--prototypes', type=int, default=1000)
+    parser.add_argument('--enums', type=int, default=50)
+    parser.add_argument('--macros', type=int, default=200)
+    parser.add_argument('--depth', type=positive, default=4,
+                        help='how deeply structs are nested')
+    parser.add_argument('--usage', type=fraction, default=0.1,
+                        help='the fraction of prototypes the source calls')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    add_arguments(parser)
+    parser.add_argument('--import', dest='use_import', metavar='NPCH',
+                        help='import NPCH rather than including HEADER')
+    parser.add_argument('header')
+    parser.add_argument('source')
+    args = parser.parse_args()
+
+    with open(args.header, 'w') as out:
+        generate_header(out, args.structs, args.prototypes, args.enums,
+                        args.depth, args.macros)
+    with open(args.source, 'w') as out:
+        generate_source(out, args.use_import or args.header,
+                        args.use_import is not None, args.structs,
+                        args.prototypes, args.enums, args.macros,
+                        args.usage)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+"""Compare importing a .npch file against parsing a header and
+against GCC's own precompiled headers.
+
+For each scenario, the header is compiled three ways: parsed as text,
+through a .gch file, and imported as a .npch file.  For each way this
+reports how long the precompiled file took to generate and how big
+it is, how long a translation unit that only includes or imports the
+header takes to compile, how long the scenario's own translation unit
+takes, and the peak RSS of the compiler for the latter.  Times are
+the median of --runs runs.
+"""
+
+import argparse
+import json
+import os
+import shlex
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import gen_header
+
+
+class Scenario:
+    def __init__(self, name, header, source, cflags=()):
+        # HEADER is the text of bench.h, and SOURCE the body of a
+        # translation unit that uses it.
+        self.name = name
+        self.header = header
+        self.source = source
+        self.cflags = list(cflags)
+
+
+def synthetic_scenario(name, args):
+    header = tempfile.SpooledTemporaryFile(mode='w+')
+    gen_header.generate_header(header, args.structs, args.prototypes,
+                               args.enums, args.depth, args.macros)
+    source = tempfile.SpooledTemporaryFile(mode='w+')
+    gen_header.generate_source(source, '', False, args.structs,
+                               args.prototypes, args.enums, args.macros,
+                               args.usage)
+    header.seek(0)
+    source.seek(0)
+    # Drop the #include line; each mode supplies its own.
+    body = source.read().split('\n', 2)[2]
+    return Scenario(name, header.read(), body)
+
+
+def pkg_config(package):
+    try:
+        out = subprocess.run(['pkg-config', '--cflags', package],
+                             stdout=subprocess.PIPE,
+                             stderr=subprocess.DEVNULL, check=True)
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    return shlex.split(out.stdout.decode())
+
+
+def real_scenarios():
+    result = [Scenario('libc',
+                       '#include <stdio.h>\n#include <stdlib.h>\n'
+                       '#include <string.h>\n',
+                       'int\nbench_main (void)\n{\n'
+                       '  char buf[16];\n'
+                       '  snprintf (buf, sizeof buf, "%d", atoi ("1"));\n'
+                       '  return (int) strlen (buf);\n}\n')]
+    cflags = pkg_config('gtk+-3.0')
+    if cflags is not None:
+        result.append(Scenario('gtk', '#include <gtk/gtk.h>\n',
+                               'int\nbench_main (void)\n{\n'
+                               '  gtk_init (0, 0);\n'
+                               '  return 0;\n}\n', cflags))
+    return result
+
+
+def run(argv, env):
+    """Run ARGV, returning the wall time and the peak RSS in KB of it
+    and its children."""
+    start = time.perf_counter()
+    pid = os.posix_spawnp(argv[0], argv, env)
+    _, status, usage = os.wait4(pid, 0)
+    elapsed = time.perf_counter() - start
+    if os.waitstatus_to_exitcode(status) != 0:
+        raise RuntimeError('failed: ' + ' '.join(argv))
+    return elapsed, usage.ru_maxrss
+
+
+def measure(argv, env, runs):
+    results = [run(argv, env) for _ in range(runs)]
+    return (statistics.median(r[0] for r in results),
+            max(r[1] for r in results))
+
+
+def write(path, text):
+    with open(path, 'w') as f:
+        f.write(text)
+
+
+def bench_scenario(scenario, args, env, work):
+    dirname = os.path.join(work, scenario.name)
+    plain = os.path.join(dirname, 'plain')
+    gch = os.path.join(dirname, 'gch')
+    for d in (plain, gch):
+        os.makedirs(d)
+        write(os.path.join(d, 'bench.h'), scenario.header)
+
+    cflags = args.cflags + scenario.cflags
+    npch = os.path.join(dirname, 'bench.npch')
+    output = os.path.join(dirname, 'out.o')
+    include = '#include "bench.h"\n\n'
+    pragma = '#pragma GCC import_pch "%s"\n\n' % npch
+
+    plugin = '-fplugin=' + args.plugin
+    arg = '-fplugin-arg-' + args.plugin_name + '-'
+    modes = [
+        ('parse', None, include, ['-I', plain]),
+        ('gch',
+         [args.cc] + cflags + ['-x', 'c-header', os.path.join(gch, 'bench.h'),
+                               '-o', os.path.join(gch, 'bench.h.gch')],
+         include, ['-Winvalid-pch', '-I', gch]),
+        ('npch',
+         [args.cc] + cflags + [plugin, arg + 'output=' + npch,
+                               '-fsyntax-only', '-x', 'c',
+                               os.path.join(plain, 'bench.h')],
+         pragma, [plugin]),
+    ]
+
+    results = []
+    for mode, generate, prologue, flags in modes:
+        result = {'scenario': scenario.name, 'mode': mode}
+        if generate is not None:
+            result['generate_s'], _ = measure(generate, env, args.runs)
+            result['size'] = os.path.getsize(generate[-1]
+                                             if mode == 'gch' else npch)
+
+        empty = os.path.join(dirname, mode + '-empty.c')
+        write(empty, prologue)
+        source = os.path.join(dirname, mode + '.c')
+        write(source, prologue + scenario.source)
+
+        compile = [args.cc] + cflags + flags + ['-c', '-o', output]
+        result['empty_s'], _ = measure(compile + [empty], env, args.runs)
+        result['compile_s'], result['rss_kb'] = measure(compile + [source],
+                                                        env, args.runs)
+        results.append(result)
+    return results
+
+
+def report(results):
+    print('%-12s %-6s %10s %10s %10s %10s %8s'
+          % ('scenario', 'mode', 'gen (s)', 'size (KB)', 'empty (s)',
+             'TU (s)', 'RSS (MB)'))
+    for r in results:
+        gen = '%.3f' % r['generate_s'] if 'generate_s' in r else '-'
+        size = '%d' % (r['size'] // 1024) if 'size' in r else '-'
+        print('%-12s %-6s %10s %10s %10.3f %10.3f %8.1f'
+              % (r['scenario'], r['mode'], gen, size, r['empty_s'],
+                 r['compile_s'], r['rss_kb'] / 1024.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--cc', default='gcc')
+    parser.add_argument('--plugin', required=True,
+                        help='the plugin shared object')
+    parser.add_argument('--plugin-name', default='libpchplugin',
+                        help='the name used in -fplugin-arg-NAME-...')
+    parser.add_argument('--cflags', default='-O0', type=shlex.split,
+                        help='flags for every compilation')
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--scenario', action='append',
+                        help='only run this scenario; may be repeated')
+    parser.add_argument('--json', metavar='FILE',
+                        help='also write the results to FILE as JSON')
+    parser.add_argument('--keep', action='store_true',
+                        help='keep the generated files')
+    gen_header.add_arguments(parser)
+    args = parser.parse_args()
+
+    scenarios = [synthetic_scenario('synthetic', args)] + real_scenarios()
+    if args.scenario:
+        scenarios = [s for s in scenarios if s.name in args.scenario]
+
+    env = dict(os.environ)
+    work = tempfile.mkdtemp(prefix='npch-bench-')
+    try:
+        results = []
+        for scenario in scenarios:
+            results += bench_scenario(scenario, args, env, work)
+    finally:
+        if args.keep:
+            print('generated files are in', work)
+        else:
+            shutil.rmtree(work)
+
+    report(results)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,416 @@
+// Assemble and write a .npch file.
+
+#include "builder.hh"
+#include "format.hh"
+#include "version.hh"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+npch_builder::npch_builder ()
+  // The empty string, with its hash of zero, comes first.
+  : m_strings (5, '\0')
+{
+  m_string_refs[std::string ()] = 0;
+}
+
+uint32_t
+npch_builder::intern (const char *name, size_t len, uint32_t hash)
+{
+  std::string key (name, len);
+  auto iter = m_string_refs.find (key);
+  if (iter != m_string_refs.end ())
+    return (*iter).second;
+
+  uint32_t result = m_strings.size ();
+  uint8_t buf[4];
+  npch_put_u32 (buf, hash);
+  m_strings.append (reinterpret_cast<const char *> (buf), 4);
+  m_strings.append (name, len);
+  m_strings.push_back ('\0');
+  m_string_refs.emplace (std::move (key), result);
+  return result;
+}
+
+void
+npch_builder::add_entry (npch_directory which, uint32_t name_ref,
+			 uint64_t record)
+{
+  entry e;
+  e.hash = npch_get_u32 (reinterpret_cast<const uint8_t *> (&m_strings[0])
+			 + name_ref);
+  e.name = name_ref;
+  e.record = record;
+  m_entries[which].push_back (e);
+}
+
+void
+npch_builder::add_dependency (const npch_dependency &dep)
+{
+  if (m_dependency_index.emplace (dep.path, m_dependencies.size ()).second)
+    m_dependencies.push_back (dep);
+}
+
+uint32_t
+npch_builder::add_base (const std::string &path, uint64_t checksum)
+{
+  auto result = m_base_index.emplace (std::make_pair (path, checksum),
+				      m_bases.size ());
+  if (result.second)
+    m_bases.push_back ({ path, checksum });
+  return result.first->second;
+}
+
+// Build the bases section, if there are any bases; see format.hh.
+
+void
+npch_builder::build_bases (std::string *out)
+{
+  if (m_bases.empty ())
+    return;
+  uint8_t buf[12];
+  npch_put_u32 (buf, m_bases.size ());
+  out->append (reinterpret_cast<const char *> (buf), 4);
+  for (const npch_base &base : m_bases)
+    {
+      npch_put_u64 (buf, base.checksum);
+      npch_put_u32 (buf + 8, base.path.size ());
+      out->append (reinterpret_cast<const char *> (buf), 12);
+      out->append (base.path);
+    }
+}
+
+void
+npch_builder::build_manifest (std::string *out)
+{
+  uint8_t buf[28];
+  npch_put_u32 (buf, m_config.size ());
+  out->append (reinterpret_cast<const char *> (buf), 4);
+  out->append (m_config);
+  npch_put_u32 (buf, m_dependencies.size ());
+  out->append (reinterpret_cast<const char *> (buf), 4);
+  for (const npch_dependency &dep : m_dependencies)
+    {
+      npch_put_u64 (buf, dep.size);
+      npch_put_u64 (buf + 8, dep.mtime);
+      npch_put_u64 (buf + 16, dep.hash);
+      npch_put_u32 (buf + 24, dep.path.size ());
+      out->append (reinterpret_cast<const char *> (buf), 28);
+      out->append (dep.path);
+    }
+}
+
+// Build a name directory holding ENTRIES, and append it to OUT.  See
+// format.hh for the layout.
+
+/* static */ void
+npch_builder::build_directory (const std::vector<entry> &entries,
+			       std::string *out)
+{
+  uint32_t log2 = 1;
+  while ((size_t (1) << log2) < 2 * entries.size ())
+    ++log2;
+  size_t mask = (size_t (1) << log2) - 1;
+
+  std::string table (4 + (mask + 1) * NPCH_BUCKET_SIZE, '\0');
+  uint8_t *base = reinterpret_cast<uint8_t *> (&table[0]);
+  npch_put_u32 (base, log2);
+
+  for (auto &entry : entries)
+    {
+      uint32_t i = npch_first_bucket (entry.hash, log2);
+      while (npch_get_u32 (base + 4 + i * NPCH_BUCKET_SIZE + 4) != 0)
+	i = (i + 1) & mask;
+
+      uint8_t *bucket = base + 4 + i * NPCH_BUCKET_SIZE;
+      npch_put_u32 (bucket, entry.hash);
+      npch_put_u32 (bucket + 4, entry.name);
+      npch_put_u32 (bucket + 8, entry.record);
+    }
+
+  out->append (table);
+}
+
+// Build a Bloom filter for the names in ENTRIES, and append it to
+// OUT.
+
+/* static */ void
+npch_builder::build_filter (const std::vector<entry> &entries,
+			    std::string *out)
+{
+  uint32_t log2 = NPCH_FILTER_MIN_LOG2;
+  while ((size_t (1) << log2) < NPCH_FILTER_BITS_PER_NAME * entries.size ())
+    ++log2;
+
+  std::string filter (4 + (size_t (1) << log2) / 8, '\0');
+  uint8_t *base = reinterpret_cast<uint8_t *> (&filter[0]);
+  npch_put_u32 (base, log2);
+  for (auto &entry : entries)
+    for (uint32_t i = 0; i < NPCH_FILTER_PROBES; ++i)
+      {
+	uint32_t bit = npch_filter_bit (entry.hash, i, log2);
+	base[4 + (bit >> 3)] |= 1 << (bit & 7);
+      }
+
+  out->append (filter);
+}
+
+// Split POOL into blocks and deflate each one, putting the block
+// table in BLOCKS and the compressed data in OUT.  Returns false if
+// zlib fails, in which case the pool should be written uncompressed.
+// This uses the streaming interface rather than compress2, since
+// that is what cc1 itself links in from zlib.
+
+static bool
+compress_pool (const char *pool, size_t pool_length,
+	       const std::vector<size_t> &record_offsets, int level,
+	       std::string *blocks, std::string *out)
+{
+  // Cut the pool at the first record boundary past each
+  // NPCH_BLOCK_SIZE bytes.
+  std::vector<size_t> cuts;
+  size_t start = 0;
+  for (size_t offset : record_offsets)
+    if (offset - start >= NPCH_BLOCK_SIZE)
+      {
+	cuts.push_back (offset);
+	start = offset;
+      }
+  cuts.push_back (pool_length);
+
+  std::vector<Bytef> scratch;
+  start = 0;
+  for (size_t end : cuts)
+    {
+      size_t length = end - start;
+      z_stream stream;
+      memset (&stream, 0, sizeof (stream));
+      if (deflateInit (&stream, level) != Z_OK)
+	return false;
+      scratch.resize (deflateBound (&stream, length));
+      stream.next_in = (reinterpret_cast<Bytef *> (const_cast<char *> (pool))
+			+ start);
+      stream.avail_in = length;
+      stream.next_out = scratch.data ();
+      stream.avail_out = scratch.size ();
+      int result = deflate (&stream, Z_FINISH);
+      size_t compressed = stream.total_out;
+      deflateEnd (&stream);
+      if (result != Z_STREAM_END)
+	return false;
+
+      uint8_t entry[NPCH_BLOCK_ENTRY_SIZE];
+      npch_put_u64 (entry, start);
+      npch_put_u64 (entry + 8, out->size ());
+      npch_put_u32 (entry + 16, length);
+      if (compressed < length)
+	{
+	  npch_put_u32 (entry + 20, compressed);
+	  out->append (reinterpret_cast<const char *> (scratch.data ()),
+		       compressed);
+	}
+      else
+	{
+	  npch_put_u32 (entry + 20, length);
+	  out->append (pool + start, length);
+	}
+      blocks->append (reinterpret_cast<const char *> (entry), sizeof (entry));
+      start = end;
+    }
+
+  return true;
+}
+
+// Write the buffers in IOV to FD, coping with short writes.  Returns
+// false and leaves errno set on failure.
+
+static bool
+write_all (int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+    {
+      ssize_t n = writev (fd, iov, count);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return false;
+	}
+
+      while (count > 0 && size_t (n) >= iov->iov_len)
+	{
+	  n -= iov->iov_len;
+	  ++iov;
+	  --count;
+	}
+      if (count > 0)
+	{
+	  iov->iov_base = static_cast<char *> (iov->iov_base) + n;
+	  iov->iov_len -= n;
+	}
+    }
+  return true;
+}
+
+// Write the buffers in IOV to FILENAME.  The data goes to a temporary
+// file in the same directory, which is then renamed into place, so a
+// concurrent reader either sees the old file or the complete new
+// one, never a partial one.
+
+static bool
+write_file (const char *filename, struct iovec *iov, int count)
+{
+  std::string temp = std::string (filename) + ".XXXXXX";
+  int fd = mkstemp (&temp[0]);
+  if (fd < 0)
+    return false;
+
+  // mkstemp uses mode 0600; give the file the usual permissions.
+  mode_t mask = umask (0);
+  umask (mask);
+  bool ok = (fchmod (fd, 0666 & ~mask) == 0
+	     && write_all (fd, iov, count));
+  int save = errno;
+  if (close (fd) != 0 && ok)
+    {
+      ok = false;
+      save = errno;
+    }
+  if (ok && rename (temp.c_str (), filename) == 0)
+    return true;
+  if (ok)
+    save = errno;
+
+  unlink (temp.c_str ());
+  errno = save;
+  return false;
+}
+
+// Check that every record in POOL is well formed and only refers to
+// records and strings that exist, so that importers need not; see
+// NPCH_FLAG_VALIDATED.  If not, describe why in *REASON.
+
+bool
+npch_builder::check_pool (const char *pool, size_t pool_length,
+			  const std::vector<size_t> &record_offsets,
+			  std::string *reason) const
+{
+  const uint8_t *data = reinterpret_cast<const uint8_t *> (pool);
+  std::vector<npch_field> fields;
+  for (size_t i = 0; i < record_offsets.size (); ++i)
+    {
+      size_t offset = record_offsets[i];
+      if (offset >= pool_length
+	  || !npch_check_record (data + offset, pool_length - offset,
+				 record_offsets.size (), m_strings.size (),
+				 m_bases.size (), &fields))
+	{
+	  *reason = "record " + std::to_string (NPCH_FIRST_RECORD + i)
+	    + " is malformed";
+	  return false;
+	}
+    }
+
+  for (const std::vector<entry> &entries : m_entries)
+    for (const entry &e : entries)
+      if (e.record >= NPCH_FIRST_RECORD + record_offsets.size ())
+	{
+	  *reason = "a name is bound to a record that does not exist";
+	  return false;
+	}
+  return true;
+}
+
+bool
+npch_builder::write (const char *filename, const char *pool,
+		     size_t pool_length,
+		     const std::vector<size_t> &record_offsets,
+		     int compression)
+{
+  // Offsets only need 8 bytes for a pool of 4GB or more.
+  uint32_t flags = 0;
+  m_unvalidated.clear ();
+  if (check_pool (pool, pool_length, record_offsets, &m_unvalidated))
+    flags |= NPCH_FLAG_VALIDATED;
+  size_t width = 4;
+  if (pool_length > 0xffffffff)
+    {
+      flags |= NPCH_FLAG_WIDE_OFFSETS;
+      width = 8;
+    }
+  std::string offsets (width * record_offsets.size (), '\0');
+  for (size_t i = 0; i < record_offsets.size (); ++i)
+    {
+      uint8_t *p = reinterpret_cast<uint8_t *> (&offsets[width * i]);
+      if (width == 8)
+	npch_put_u64 (p, record_offsets[i]);
+      else
+	npch_put_u32 (p, record_offsets[i]);
+    }
+
+  std::string sections[NPCH_NUM_SECTIONS];
+  for (int i = 0; i < NPCH_NUM_DIRECTORIES; ++i)
+    {
+      build_directory (m_entries[i], &sections[i]);
+      build_filter (m_entries[i], &sections[NPCH_SECTION_FILTERS]);
+    }
+  sections[NPCH_SECTION_RECORDS] = offsets;
+  build_manifest (&sections[NPCH_SECTION_MANIFEST]);
+  build_bases (&sections[NPCH_SECTION_BASES]);
+  if (compression >= 0
+      && compress_pool (pool, pool_length, record_offsets, compression,
+			&sections[NPCH_SECTION_BLOCKS],
+			&sections[NPCH_SECTION_POOL]))
+    flags |= NPCH_FLAG_COMPRESSED;
+  else
+    {
+      sections[NPCH_SECTION_BLOCKS].clear ();
+      sections[NPCH_SECTION_POOL].clear ();
+    }
+
+  // Point at each section rather than copying it again.  The string
+  // table and an uncompressed pool are written straight from where
+  // they are.
+  struct iovec iov[1 + NPCH_NUM_SECTIONS];
+  for (int i = 0; i < NPCH_NUM_SECTIONS; ++i)
+    {
+      iov[1 + i].iov_base = &sections[i][0];
+      iov[1 + i].iov_len = sections[i].size ();
+    }
+  iov[1 + NPCH_SECTION_STRINGS].iov_base = &m_strings[0];
+  iov[1 + NPCH_SECTION_STRINGS].iov_len = m_strings.size ();
+  if ((flags & NPCH_FLAG_COMPRESSED) == 0)
+    {
+      iov[1 + NPCH_SECTION_POOL].iov_base = const_cast<char *> (pool);
+      iov[1 + NPCH_SECTION_POOL].iov_len = pool_length;
+    }
+
+  std::string header (NPCH_HEADER_SIZE, '\0');
+  uint8_t *p = reinterpret_cast<uint8_t *> (&header[0]);
+  npch_put_u32 (p, PCH_PLUGIN_VERSION);
+  npch_put_u32 (p + 4, flags);
+  uint64_t offset = NPCH_HEADER_SIZE;
+  for (int i = 0; i < NPCH_NUM_SECTIONS; ++i)
+    {
+      npch_put_u64 (p + 16 + 16 * i, offset);
+      npch_put_u64 (p + 24 + 16 * i, iov[1 + i].iov_len);
+      offset += iov[1 + i].iov_len;
+    }
+  iov[0].iov_base = &header[0];
+  iov[0].iov_len = header.size ();
+
+  uint64_t hash = npch_hash_bytes (p, NPCH_CHECKSUM_OFFSET);
+  hash = npch_hash_bytes (p + NPCH_CHECKSUM_OFFSET + 8,
+			  NPCH_HEADER_SIZE - NPCH_CHECKSUM_OFFSET - 8, hash);
+  for (int i = 1; i <= NPCH_NUM_SECTIONS; ++i)
+    hash = npch_hash_bytes (static_cast<const uint8_t *> (iov[i].iov_base),
+			    iov[i].iov_len, hash);
+  npch_put_u64 (p + NPCH_CHECKSUM_OFFSET, hash);
+
+  return write_file (filename, iov, 1 + NPCH_NUM_SECTIONS);
+}
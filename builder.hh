@@ -0,0 +1,105 @@
+// Assemble and write a .npch file.  This does not depend on GCC, so
+// it is shared by the plugin and the tools.
+
+#ifndef NPCH_BUILDER_HH
+#define NPCH_BUILDER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "npchfile.hh"
+
+class npch_builder
+{
+public:
+
+  npch_builder ();
+
+  npch_builder (const npch_builder &) = delete;
+  npch_builder &operator= (const npch_builder &) = delete;
+
+  // Add LEN bytes of NAME to the string table, unless they are
+  // already there, and return the reference to its entry.  HASH is
+  // the npch_hash_string of the name.  The empty string is always
+  // reference zero.
+  uint32_t intern (const char *name, size_t len, uint32_t hash);
+
+  // Bind the name NAME_REF, as returned by intern, to the record
+  // RECORD in the directory WHICH.  A name must only be bound once in
+  // each directory.
+  void add_entry (npch_directory which, uint32_t name_ref,
+		  uint64_t record);
+
+  // Record the compiler configuration the file is built with.
+  void set_config (const std::string &config)
+  {
+    m_config = config;
+  }
+
+  // Record that the file is layered on the .npch file at PATH, whose
+  // checksum is CHECKSUM, and return its index for 'X' records.  A
+  // base is only added once; the same path with another checksum is
+  // another base, since its records may be numbered differently.
+  uint32_t add_base (const std::string &path, uint64_t checksum);
+
+  // Record that the file depends on DEP.  Only the first dependency
+  // with a given path is kept.
+  void add_dependency (const npch_dependency &dep);
+
+  // Write the file to FILENAME.  POOL holds POOL_LENGTH bytes of
+  // records, and RECORD_OFFSETS the offset of each record in it, in
+  // order of ID and so in increasing order.  COMPRESSION is the zlib
+  // level for the pool, or -1 to leave it uncompressed.  The file is
+  // written under a temporary name and renamed into place.  Returns
+  // false and leaves errno set on failure.
+  bool write (const char *filename, const char *pool, size_t pool_length,
+	      const std::vector<size_t> &record_offsets, int compression);
+
+  // If the records given to the last write were not all well formed,
+  // so that it could not set NPCH_FLAG_VALIDATED, why; otherwise
+  // empty.
+  const std::string &unvalidated () const
+  {
+    return m_unvalidated;
+  }
+
+private:
+
+  struct entry
+  {
+    uint32_t hash;
+    uint32_t name;
+    uint64_t record;
+  };
+
+  static void build_directory (const std::vector<entry> &, std::string *);
+  static void build_filter (const std::vector<entry> &, std::string *);
+  void build_manifest (std::string *);
+  void build_bases (std::string *);
+  bool check_pool (const char *, size_t, const std::vector<size_t> &,
+		   std::string *) const;
+
+  // The string table, and the reference of each string in it.
+  std::string m_strings;
+  std::unordered_map<std::string, uint32_t> m_string_refs;
+
+  // The entries of each directory.
+  std::vector<entry> m_entries[NPCH_NUM_DIRECTORIES];
+
+  // The manifest; see format.hh.
+  std::string m_config;
+  std::vector<npch_dependency> m_dependencies;
+  std::unordered_map<std::string, size_t> m_dependency_index;
+
+  // The bases, and the index of each by path.
+  std::vector<npch_base> m_bases;
+  std::map<std::pair<std::string, uint64_t>, uint32_t> m_base_index;
+
+  // See unvalidated.
+  std::string m_unvalidated;
+};
+
+#endif // NPCH_BUILDER_HH
@@ -0,0 +1,125 @@
+// A directory of .npch files generated on demand.
+
+#include "cache.hh"
+#include "mapfile.hh"
+#include "npchfile.hh"
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// True if FILENAME is a usable .npch file whose dependencies have not
+// changed.
+
+static bool
+fresh_p (const std::string &filename, const std::string &config)
+{
+  mapped_file file;
+  if (!file.open (filename.c_str ()))
+    return false;
+  npch_file npch (file.data (), file.size ());
+  std::string reason;
+  return npch.init () && npch.check_manifest (config, &reason);
+}
+
+// Run ARGV and wait for it.  Returns false and describes the problem
+// in *MESSAGE on failure.
+
+static bool
+run (const std::vector<std::string> &argv, std::string *message)
+{
+  std::vector<char *> args;
+  for (const std::string &arg : argv)
+    args.push_back (const_cast<char *> (arg.c_str ()));
+  args.push_back (nullptr);
+
+  pid_t pid;
+  int err = posix_spawnp (&pid, args[0], nullptr, nullptr, args.data (),
+			  environ);
+  if (err != 0)
+    {
+      *message = argv[0] + ": " + strerror (err);
+      return false;
+    }
+
+  int status;
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      {
+	*message = std::string ("waitpid: ") + strerror (errno);
+	return false;
+      }
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      *message = argv[0] + " failed";
+      return false;
+    }
+  return true;
+}
+
+// Make the directory DIR and any missing parents.  Returns false and
+// describes the problem in *MESSAGE on failure.
+
+static bool
+make_directories (const std::string &dir, std::string *message)
+{
+  for (size_t slash = dir.find ('/', 1); ; slash = dir.find ('/', slash + 1))
+    {
+      std::string prefix = dir.substr (0, slash);
+      if (mkdir (prefix.c_str (), 0777) != 0 && errno != EEXIST)
+	{
+	  *message = prefix + ": " + strerror (errno);
+	  return false;
+	}
+      if (slash == std::string::npos)
+	return true;
+    }
+}
+
+bool
+npch_cache_ensure (const npch_cache_request &request,
+		   const std::string &config, std::string *message)
+{
+  // The common case is a hit, which needs no lock: files only ever
+  // appear in the cache by being renamed into place whole.
+  if (fresh_p (request.npch, config))
+    return true;
+
+  std::string dir = request.npch.substr (0, request.npch.rfind ('/'));
+  if (!make_directories (dir, message))
+    return false;
+
+  int fd = open (request.lock.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0)
+    {
+      *message = request.lock + ": " + strerror (errno);
+      return false;
+    }
+  while (flock (fd, LOCK_EX) != 0)
+    if (errno != EINTR)
+      {
+	*message = request.lock + ": " + strerror (errno);
+	close (fd);
+	return false;
+      }
+
+  // Someone else may have generated the file while we waited.  The
+  // lock file is never removed, as that would race with a
+  // compilation that has just opened it.
+  bool ok = (fresh_p (request.npch, config)
+	     || (run (request.argv, message)
+		 && fresh_p (request.npch, config)));
+  if (ok)
+    message->clear ();
+  else if (message->empty ())
+    *message = request.npch + " was not usable after generating it";
+
+  close (fd);
+  return ok;
+}
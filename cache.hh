@@ -0,0 +1,31 @@
+// A directory of .npch files generated on demand.  This does not
+// depend on GCC, so that it can run on a worker thread.
+
+#ifndef NPCH_CACHE_HH
+#define NPCH_CACHE_HH
+
+#include <string>
+#include <vector>
+
+// How to find or make the .npch file for one header.
+struct npch_cache_request
+{
+  // The header, as found on the include path.
+  std::string header;
+  // Where the .npch file lives in the cache.
+  std::string npch;
+  // The lock file serializing generation of NPCH.
+  std::string lock;
+  // The command that writes NPCH; argv[0] is looked up in PATH.
+  std::vector<std::string> argv;
+};
+
+// Make sure that REQUEST.npch exists and is up to date for the
+// compiler configuration CONFIG, generating it if needed.  Concurrent
+// compilations wanting the same file wait for each other instead of
+// generating it twice.  Returns false and describes the problem in
+// *MESSAGE on failure.
+bool npch_cache_ensure (const npch_cache_request &request,
+			const std::string &config, std::string *message);
+
+#endif // NPCH_CACHE_HH
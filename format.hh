@@ -0,0 +1,393 @@
+// Layout of .npch files.  This is shared by the writer and the
+// reader, and does not depend on GCC.
+
+#ifndef NPCH_FORMAT_HH
+#define NPCH_FORMAT_HH
+
+#include <cstddef>
+#include <cstdint>
+
+// A file starts with a header:
+//
+//   version			4 bytes
+//   flags			4 bytes
+//   checksum			8 bytes
+//   section table		NPCH_NUM_SECTIONS entries
+//
+// Each section table entry is an 8 byte offset from the start of the
+// file followed by an 8 byte length.  Fixed-size integers are
+// little-endian.  The checksum is the npch_hash_bytes of the rest of
+// the file: the version and flags, then everything after the
+// checksum.
+//
+// Inside records, integers are variable length: unsigned values are
+// LEB128 encoded, and signed values are zigzag encoded first, so that
+// small values of either sign take a single byte.
+
+enum npch_section
+{
+  // Hash table mapping symbol names to record IDs.
+  NPCH_SECTION_SYMBOLS,
+  // Hash table mapping tag names to record IDs.
+  NPCH_SECTION_TAGS,
+  // Hash table mapping macro names to record IDs.
+  NPCH_SECTION_MACROS,
+  // Bloom filters for the symbol, tag and macro directories, in that
+  // order.
+  NPCH_SECTION_FILTERS,
+  // The string table.
+  NPCH_SECTION_STRINGS,
+  // The pool offset of each record, in order of ID.  Each offset is 4
+  // bytes, or 8 if NPCH_FLAG_WIDE_OFFSETS is set.
+  NPCH_SECTION_RECORDS,
+  // The block table of a compressed constant pool; empty if the pool
+  // is not compressed.
+  NPCH_SECTION_BLOCKS,
+  // The headers and compiler configuration the file was built from.
+  NPCH_SECTION_MANIFEST,
+  // The other .npch files that this one refers to records of.
+  NPCH_SECTION_BASES,
+  // The constant pool holding the records.
+  NPCH_SECTION_POOL,
+
+  NPCH_NUM_SECTIONS
+};
+
+const size_t NPCH_CHECKSUM_OFFSET = 8;
+const size_t NPCH_HEADER_SIZE = 16 + 16 * NPCH_NUM_SECTIONS;
+
+// The name directories.  Each is stored in the section with the same
+// number.  C keeps macros, tags and ordinary identifiers apart, so
+// the same name may be bound in each of them.
+enum npch_directory
+{
+  NPCH_DIRECTORY_SYMBOLS = NPCH_SECTION_SYMBOLS,
+  NPCH_DIRECTORY_TAGS = NPCH_SECTION_TAGS,
+  NPCH_DIRECTORY_MACROS = NPCH_SECTION_MACROS,
+
+  NPCH_NUM_DIRECTORIES
+};
+
+// Bits in the flags word of the header.
+const uint32_t NPCH_FLAG_WIDE_OFFSETS = 1;
+const uint32_t NPCH_FLAG_COMPRESSED = 2;
+// The writer checked that every record is well formed and only refers
+// to records and strings in the file; see npch_check_record.  Once
+// the checksum shows the file is as written, an importer can rely on
+// this instead of checking every record again.
+const uint32_t NPCH_FLAG_VALIDATED = 4;
+
+// If NPCH_FLAG_COMPRESSED is set, the constant pool is split into
+// blocks that are deflated independently, so that a reader only has
+// to inflate the blocks holding the records it uses.  Blocks are only
+// cut between records, so a record never spans two blocks.  Record
+// offsets still refer to the uncompressed pool.  Each block table
+// entry is:
+//
+//   uncompressed offset of the block	8 bytes
+//   offset of the data in the pool	8 bytes
+//   uncompressed length		4 bytes
+//   compressed length			4 bytes
+//
+// Entries are in order and the blocks are contiguous.  A block whose
+// two lengths are equal is stored as is, because deflating it did not
+// make it smaller.
+
+const size_t NPCH_BLOCK_ENTRY_SIZE = 24;
+// The writer starts a new block at the first record boundary after
+// this many bytes.
+const size_t NPCH_BLOCK_SIZE = 32768;
+
+// Record IDs below NPCH_FIRST_RECORD are not stored in the file.
+// They stand for the standard C scalar types, so that a reference to
+// one of these costs a single byte and needs no record.
+enum npch_builtin
+{
+  NPCH_BUILTIN_VOID,
+  NPCH_BUILTIN_BOOL,
+  NPCH_BUILTIN_CHAR,
+  NPCH_BUILTIN_SIGNED_CHAR,
+  NPCH_BUILTIN_UNSIGNED_CHAR,
+  NPCH_BUILTIN_SHORT,
+  NPCH_BUILTIN_UNSIGNED_SHORT,
+  NPCH_BUILTIN_INT,
+  NPCH_BUILTIN_UNSIGNED_INT,
+  NPCH_BUILTIN_LONG,
+  NPCH_BUILTIN_UNSIGNED_LONG,
+  NPCH_BUILTIN_LONG_LONG,
+  NPCH_BUILTIN_UNSIGNED_LONG_LONG,
+  NPCH_BUILTIN_FLOAT,
+  NPCH_BUILTIN_DOUBLE,
+  NPCH_BUILTIN_LONG_DOUBLE,
+
+  NPCH_FIRST_RECORD
+};
+
+// The flags kept for each node of an inline function body; see
+// hash_writer::write_body.  Whether a node has a type decides whether
+// a type reference follows, so the format depends on these.
+enum npch_node_flag
+{
+  NPCH_NODE_HAS_TYPE = 1,
+  NPCH_NODE_SIDE_EFFECTS = 2,
+  NPCH_NODE_VOLATILE = 4,
+  NPCH_NODE_READONLY = 8,
+  NPCH_NODE_CONSTANT = 16,
+  NPCH_NODE_ADDRESSABLE = 32,
+  NPCH_NODE_USED = 64,
+  NPCH_NODE_NO_WARNING = 128,
+  // These only apply to declarations.
+  NPCH_NODE_ARTIFICIAL = 256,
+  NPCH_NODE_IGNORED = 512,
+  NPCH_NODE_REGISTER = 1024
+};
+
+// How deeply the items of a body may nest, counting the outermost
+// ones as depth 0.  The writer exports a function with a deeper body
+// as a declaration only, and a record with one is malformed, so that
+// a corrupt file cannot exhaust the stack of its reader.
+const unsigned NPCH_MAX_ITEM_DEPTH = 1000;
+
+// Every name in the file is stored once, in the string table, and is
+// referred to by the offset of its entry from the start of the
+// section.  An entry is:
+//
+//   hash of the name		4 bytes
+//   name			NUL-terminated
+//
+// The first entry is always the empty string, so a reference of zero
+// means "no name".
+//
+// A source location is stored as a string table reference for the
+// name of its file, zero if it has none, and its line, negated if the
+// file is a system header, so that an importer still treats it as
+// one when deciding which warnings to give.
+
+// The manifest records what the file was built from, so that an
+// importer can tell whether it is stale:
+//
+//   length of the configuration		4 bytes
+//   configuration				that many bytes
+//   number of dependencies			4 bytes
+//   dependencies
+//
+// The configuration is an opaque string describing the compiler and
+// the target ABI; an importer only uses the file if its own string
+// is the same.  Each dependency is:
+//
+//   size of the file				8 bytes
+//   modification time, in nanoseconds		8 bytes
+//   npch_hash_bytes of the contents		8 bytes
+//   length of the path				4 bytes
+//   absolute path				that many bytes
+//
+// A dependency whose size and time are unchanged is assumed to be
+// unchanged; otherwise the importer hashes it.
+
+// A file may be layered on other .npch files, its bases, and refer
+// to their records instead of copying them.  The bases section is:
+//
+//   number of bases				4 bytes
+//   bases
+//
+// Each base is:
+//
+//   checksum of the base, from its header	8 bytes
+//   length of the path				4 bytes
+//   absolute path				that many bytes
+//
+// A record of a base is referred to through an 'X' record holding the
+// index of the base and the ID of the record in it, so that the rest
+// of the file refers to it with an ordinary record ID.
+
+// A name directory is an open-addressing hash table with linear
+// probing, so that a lookup can probe the mapped file directly:
+//
+//   log2 of the number of buckets	4 bytes
+//   buckets				12 bytes each
+//
+// A bucket holds the hash of the name, a string table reference for
+// the name, and the ID of the record.  A name reference of zero marks
+// an empty bucket.  Tables are at most half full, so a probe sequence
+// always ends at an empty bucket.
+
+const size_t NPCH_BUCKET_SIZE = 12;
+
+// Each Bloom filter is:
+//
+//   log2 of the number of bits		4 bytes
+//   bits				2**log2 / 8 bytes
+//
+// A name sets NPCH_FILTER_PROBES bits, chosen by npch_filter_bit.
+// The bit index only depends on the filter size through a final
+// mask, so a filter can be widened by repeating its bytes; this is
+// how filters of different sizes are combined.
+
+const uint32_t NPCH_FILTER_PROBES = 4;
+const uint32_t NPCH_FILTER_BITS_PER_NAME = 10;
+const uint32_t NPCH_FILTER_MIN_LOG2 = 6;
+
+inline uint32_t
+npch_get_u32 (const uint8_t *p)
+{
+  return (uint32_t (p[0]) | (uint32_t (p[1]) << 8)
+	  | (uint32_t (p[2]) << 16) | (uint32_t (p[3]) << 24));
+}
+
+inline void
+npch_put_u32 (uint8_t *p, uint32_t val)
+{
+  for (int i = 0; i < 4; ++i)
+    {
+      p[i] = val & 0xff;
+      val >>= 8;
+    }
+}
+
+inline uint64_t
+npch_get_u64 (const uint8_t *p)
+{
+  return uint64_t (npch_get_u32 (p)) | (uint64_t (npch_get_u32 (p + 4)) << 32);
+}
+
+inline void
+npch_put_u64 (uint8_t *p, uint64_t val)
+{
+  npch_put_u32 (p, val & 0xffffffff);
+  npch_put_u32 (p + 4, val >> 32);
+}
+
+const size_t NPCH_MAX_VARINT = 10;
+
+// Encode VAL as LEB128 into BUF, which must have room for
+// NPCH_MAX_VARINT bytes.  Returns the number of bytes used.
+inline size_t
+npch_encode_uint (uint8_t *buf, uint64_t val)
+{
+  size_t n = 0;
+  do
+    {
+      uint8_t byte = val & 0x7f;
+      val >>= 7;
+      if (val != 0)
+	byte |= 0x80;
+      buf[n++] = byte;
+    }
+  while (val != 0);
+  return n;
+}
+
+// Decode a LEB128 value starting at *P, which must be before END.
+// On success, advance *P past it.
+inline bool
+npch_decode_uint (const uint8_t **p, const uint8_t *end, uint64_t *result)
+{
+  uint64_t val = 0;
+  const uint8_t *q = *p;
+  for (unsigned shift = 0; shift < 64 && q < end; shift += 7)
+    {
+      uint8_t byte = *q++;
+      val |= uint64_t (byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+	{
+	  *p = q;
+	  *result = val;
+	  return true;
+	}
+    }
+  return false;
+}
+
+// Decode a LEB128 value at *P without bounds checks, advancing *P
+// past it.  Only for records that are known to be well formed.
+inline uint64_t
+npch_decode_uint_unchecked (const uint8_t **p)
+{
+  const uint8_t *q = *p;
+  uint64_t val = *q & 0x7f;
+  for (unsigned shift = 7; (*q++ & 0x80) != 0; shift += 7)
+    val |= uint64_t (*q & 0x7f) << shift;
+  *p = q;
+  return val;
+}
+
+inline uint64_t
+npch_zigzag (int64_t val)
+{
+  return (uint64_t (val) << 1) ^ uint64_t (val >> 63);
+}
+
+inline int64_t
+npch_unzigzag (uint64_t val)
+{
+  return int64_t (val >> 1) ^ -int64_t (val & 1);
+}
+
+// Hash LEN bytes of STR.  This must agree with libcpp's identifier
+// hash (see HT_HASHSTEP and HT_HASHFINISH in symtab.h), so that the
+// reader can probe a directory using IDENTIFIER_HASH_VALUE without
+// rehashing the name.
+inline uint32_t
+npch_hash_string (const char *str, size_t len)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *> (str);
+  uint32_t r = 0;
+  for (size_t i = 0; i < len; ++i)
+    r = r * 67 + (p[i] - 113);
+  return r + len;
+}
+
+// Hash LEN bytes at DATA, continuing from HASH.  This is 64-bit
+// FNV-1a, used to fingerprint the contents of dependencies.
+const uint64_t NPCH_HASH_BYTES_INIT = 0xcbf29ce484222325ull;
+
+inline uint64_t
+npch_hash_bytes (const uint8_t *data, size_t len,
+		 uint64_t hash = NPCH_HASH_BYTES_INIT)
+{
+  for (size_t i = 0; i < len; ++i)
+    {
+      hash ^= data[i];
+      hash *= 0x100000001b3ull;
+    }
+  return hash;
+}
+
+// The first bucket to probe for HASH in a table with 2**LOG2
+// buckets.  The identifier hash is weak in its low bits, so use the
+// high bits of a multiplicative mix.
+inline uint32_t
+npch_first_bucket (uint32_t hash, uint32_t log2)
+{
+  return uint32_t (hash * 0x9e3779b1u) >> (32 - log2);
+}
+
+// The bit that probe I of HASH sets in a filter of 2**LOG2 bits.
+inline uint32_t
+npch_filter_bit (uint32_t hash, uint32_t i, uint32_t log2)
+{
+  // Double hashing, from a murmur-style mix of the identifier hash.
+  uint32_t h = hash;
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  uint32_t step = ((h >> 16) | (h << 16)) | 1;
+  return (h + i * step) & ((uint32_t (1) << log2) - 1);
+}
+
+// True if a filter of 2**LOG2 bits in BITS may contain HASH.
+inline bool
+npch_filter_test (const uint8_t *bits, uint32_t log2, uint32_t hash)
+{
+  for (uint32_t i = 0; i < NPCH_FILTER_PROBES; ++i)
+    {
+      uint32_t bit = npch_filter_bit (hash, i, log2);
+      if ((bits[bit >> 3] & (1 << (bit & 7))) == 0)
+	return false;
+    }
+  return true;
+}
+
+#endif // NPCH_FORMAT_HH
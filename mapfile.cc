@@ -0,0 +1,103 @@
+// Read-only file mappings.
+
+#include "mapfile.hh"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mapped_file::~mapped_file ()
+{
+  if (m_data != nullptr)
+    munmap (const_cast<uint8_t *> (m_data), m_size);
+}
+
+bool
+mapped_file::open (const char *filename)
+{
+  int fd = ::open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat sbuf;
+  if (fstat (fd, &sbuf) < 0)
+    {
+      int save = errno;
+      close (fd);
+      errno = save;
+      return false;
+    }
+  if (sbuf.st_size == 0)
+    {
+      close (fd);
+      errno = EINVAL;
+      return false;
+    }
+
+  // The mapping is read-only, so parallel compilations importing the
+  // same file share its page cache pages, and only the pages we
+  // actually touch are ever read in.
+  void *addr = mmap (nullptr, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int save = errno;
+  close (fd);
+  if (addr == MAP_FAILED)
+    {
+      errno = save;
+      return false;
+    }
+
+  m_data = static_cast<const uint8_t *> (addr);
+  m_size = sbuf.st_size;
+  return true;
+}
+
+void
+mapped_file::advise (access_policy policy, size_t offset, size_t length)
+{
+  if (m_data == nullptr || offset >= m_size)
+    return;
+  if (length > m_size - offset)
+    length = m_size - offset;
+
+  int advice;
+  switch (policy)
+    {
+    case ACCESS_RANDOM:
+      advice = MADV_RANDOM;
+      break;
+    case ACCESS_SEQUENTIAL:
+      advice = MADV_SEQUENTIAL;
+      break;
+    case ACCESS_WILLNEED:
+      advice = MADV_WILLNEED;
+      break;
+    default:
+      advice = MADV_NORMAL;
+      break;
+    }
+
+  // madvise wants a page-aligned start.
+  uintptr_t page = sysconf (_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t> (m_data + offset);
+  uintptr_t aligned = start & ~(page - 1);
+  madvise (reinterpret_cast<void *> (aligned), length + (start - aligned),
+	   advice);
+}
+
+/* static */ bool
+mapped_file::parse_policy (const char *name, access_policy *result)
+{
+  if (strcmp (name, "normal") == 0)
+    *result = ACCESS_NORMAL;
+  else if (strcmp (name, "random") == 0)
+    *result = ACCESS_RANDOM;
+  else if (strcmp (name, "sequential") == 0)
+    *result = ACCESS_SEQUENTIAL;
+  else if (strcmp (name, "willneed") == 0)
+    *result = ACCESS_WILLNEED;
+  else
+    return false;
+  return true;
+}
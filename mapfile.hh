@@ -0,0 +1,68 @@
+// A read-only memory mapping of a whole file.
+
+#ifndef NPCH_MAPFILE_HH
+#define NPCH_MAPFILE_HH
+
+#include <cstddef>
+#include <cstdint>
+
+class mapped_file
+{
+public:
+
+  // How the pages of a mapping are expected to be touched.  These
+  // are passed through to madvise.
+  enum access_policy
+  {
+    ACCESS_NORMAL,
+    ACCESS_RANDOM,
+    ACCESS_SEQUENTIAL,
+    ACCESS_WILLNEED
+  };
+
+  mapped_file ()
+    : m_data (nullptr),
+      m_size (0)
+  {
+  }
+
+  ~mapped_file ();
+
+  mapped_file (const mapped_file &) = delete;
+  mapped_file &operator= (const mapped_file &) = delete;
+
+  // Map FILENAME read-only.  Returns false and leaves errno set on
+  // failure.
+  bool open (const char *filename);
+
+  // Advise the kernel about the expected use of the bytes
+  // [OFFSET, OFFSET + LENGTH) of the mapping.  This is only a hint,
+  // so failures are ignored.
+  void advise (access_policy policy, size_t offset, size_t length);
+
+  void advise (access_policy policy)
+  {
+    advise (policy, 0, m_size);
+  }
+
+  const uint8_t *data () const
+  {
+    return m_data;
+  }
+
+  size_t size () const
+  {
+    return m_size;
+  }
+
+  // Parse the name of an access policy, as given on the command
+  // line.  Returns false if NAME is not recognized.
+  static bool parse_policy (const char *name, access_policy *result);
+
+private:
+
+  const uint8_t *m_data;
+  size_t m_size;
+};
+
+#endif // NPCH_MAPFILE_HH
@@ -0,0 +1,136 @@
+// Merge the directories of several imports.
+
+#include "readhash.hh"
+#include "merged.hh"
+#include "format.hh"
+#include <string.h>
+
+void
+merged_index::add (mapped_hash *map, unsigned ordinal)
+{
+  // Scanning the directories does not need the lock; only the
+  // insertions do.
+  std::vector<entry> entries[2];
+  for (int which = 0; which < 2; ++which)
+    map->for_each_entry (npch_directory (which),
+			 [&] (uint32_t hash, const char *name, size_t len,
+			      uint32_t record)
+			 {
+			   entry e;
+			   e.hash = hash;
+			   e.len = len;
+			   e.name = name;
+			   e.map = map;
+			   e.record = record;
+			   e.ordinal = ordinal;
+			   e.duplicated = false;
+			   entries[which].push_back (e);
+			 });
+
+  std::lock_guard<std::mutex> guard (m_lock);
+  for (int which = 0; which < 2; ++which)
+    {
+      for (auto &e : entries[which])
+	insert (which, e);
+
+      const uint8_t *bits;
+      uint32_t log2;
+      map->get_filter (npch_directory (which), &bits, &log2);
+      merge_filter (which, bits, log2);
+    }
+}
+
+void
+merged_index::merge_filter (int which, const uint8_t *bits, uint32_t log2)
+{
+  // Filter bits are masked by the filter size, so repeating a
+  // filter's bytes yields the same filter at a larger size.  Widen
+  // whichever of the two filters is smaller, then OR them.
+  std::vector<uint8_t> &filter = m_filter[which];
+  if (log2 > m_filter_log2[which])
+    {
+      size_t old_size = filter.size ();
+      filter.resize ((size_t (1) << log2) / 8);
+      for (size_t i = old_size; old_size > 0 && i < filter.size (); ++i)
+	filter[i] = filter[i % old_size];
+      m_filter_log2[which] = log2;
+    }
+
+  size_t size = (size_t (1) << log2) / 8;
+  for (size_t i = 0; i < filter.size (); ++i)
+    filter[i] |= bits[i % size];
+}
+
+void
+merged_index::grow (int which)
+{
+  std::vector<entry> old;
+  old.swap (m_table[which]);
+  m_log2[which] = old.empty () ? 6 : m_log2[which] + 1;
+  m_table[which].resize (size_t (1) << m_log2[which]);
+  m_count[which] = 0;
+  for (auto &e : old)
+    if (e.name != nullptr)
+      insert (which, e);
+}
+
+void
+merged_index::insert (int which, const entry &e)
+{
+  std::vector<entry> &table = m_table[which];
+  if (2 * (m_count[which] + 1) > table.size ())
+    grow (which);
+
+  size_t mask = table.size () - 1;
+  for (size_t i = npch_first_bucket (e.hash, m_log2[which]); ;
+       i = (i + 1) & mask)
+    {
+      entry &slot = table[i];
+      if (slot.name == nullptr)
+	{
+	  slot = e;
+	  ++m_count[which];
+	  return;
+	}
+
+      if (slot.hash == e.hash && slot.len == e.len
+	  && memcmp (slot.name, e.name, e.len) == 0)
+	{
+	  // Workers can finish in any order, so keep whichever import
+	  // came first rather than whichever was added first.
+	  bool duplicated = slot.duplicated || slot.map != e.map;
+	  if (e.ordinal < slot.ordinal)
+	    slot = e;
+	  slot.duplicated = duplicated;
+	  return;
+	}
+    }
+}
+
+bool
+merged_index::find (bool tags, uint32_t hash, const char *name,
+		    size_t len, entry *result)
+{
+  std::lock_guard<std::mutex> guard (m_lock);
+  int which = tags ? 1 : 0;
+  const std::vector<entry> &table = m_table[which];
+  if (table.empty ()
+      || !npch_filter_test (m_filter[which].data (), m_filter_log2[which],
+			    hash))
+    return false;
+
+  size_t mask = table.size () - 1;
+  for (size_t i = npch_first_bucket (hash, m_log2[which]); ;
+       i = (i + 1) & mask)
+    {
+      const entry &slot = table[i];
+      if (slot.name == nullptr)
+	return false;
+      if (slot.hash == hash && slot.len == len
+	  && memcmp (slot.name, name, len) == 0)
+	{
+	  *result = slot;
+	  return true;
+	}
+    }
+}
@@ -0,0 +1,74 @@
+// An index of the names exported by all the imports of a
+// compilation.
+
+#ifndef NPCH_MERGED_HH
+#define NPCH_MERGED_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+class mapped_hash;
+
+class merged_index
+{
+public:
+
+  // Where a name is bound.
+  struct entry
+  {
+    uint32_t hash;
+    uint32_t len;
+    const char *name;
+    mapped_hash *map;
+    uint32_t record;
+    // The position of MAP in the import order.  When several imports
+    // define a name, the earliest one wins.
+    unsigned ordinal;
+    // True if more than one import defines this name.
+    bool duplicated;
+  };
+
+  merged_index ()
+    : m_log2 { 0, 0 },
+      m_count { 0, 0 },
+      m_filter_log2 { 0, 0 }
+  {
+  }
+
+  merged_index (const merged_index &) = delete;
+  merged_index &operator= (const merged_index &) = delete;
+
+  // Add all the symbols and tags of MAP, which is import number
+  // ORDINAL.  This may be called from several worker threads at once.
+  // Macros are not indexed; the plugin defines them at the import.
+  void add (mapped_hash *map, unsigned ordinal);
+
+  // Find the entry for a name, and copy it to *RESULT.  TAGS selects
+  // the tag namespace.  This may run while workers are still adding
+  // other imports; it only sees the ones that have been added.
+  bool find (bool tags, uint32_t hash, const char *name, size_t len,
+	     entry *result);
+
+private:
+
+  void insert (int which, const entry &e);
+  void grow (int which);
+  void merge_filter (int which, const uint8_t *bits, uint32_t log2);
+
+  std::mutex m_lock;
+
+  // Open-addressing tables for symbols and tags; an empty slot has a
+  // null NAME.  Each has 2**M_LOG2 slots.
+  std::vector<entry> m_table[2];
+  uint32_t m_log2[2];
+  size_t m_count[2];
+
+  // The union of the Bloom filters of all the imports, for each
+  // table.  Each has 2**M_FILTER_LOG2 bits.
+  std::vector<uint8_t> m_filter[2];
+  uint32_t m_filter_log2[2];
+};
+
+#endif // NPCH_MERGED_HH
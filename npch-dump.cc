@@ -0,0 +1,507 @@
+// npch-dump - describe what a .npch file is made of.
+//
+// Usage: npch-dump [-j] [-n COUNT] FILE
+//
+// This reports the size of each section, the number and total size
+// of the records of each kind, the largest structs, unions and enums,
+// the symbols that reach the most records, duplicated strings and
+// records, and records that no name can reach.  Records of the files
+// it is layered on are not followed.  The lists are cut at
+// COUNT entries, 10 by default.  With -j the report is written as a
+// JSON object instead, for tracking over time.
+
+#include "format.hh"
+#include "mapfile.hh"
+#include "npchfile.hh"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static const char *progname = "npch-dump";
+
+static const char *const section_names[NPCH_NUM_SECTIONS] =
+{
+  "symbols", "tags", "macros", "filters", "strings", "records", "blocks",
+  "manifest", "bases", "pool"
+};
+
+static const char *const directory_names[NPCH_NUM_DIRECTORIES] =
+{
+  "symbol", "tag", "macro"
+};
+
+struct record
+{
+  std::vector<npch_field> fields;
+  // The encoded size, uncompressed.
+  size_t bytes;
+};
+
+// A directory entry.
+struct binding
+{
+  npch_directory directory;
+  std::string name;
+  uint64_t record;
+};
+
+// An entry in one of the "largest" lists.
+struct ranked
+{
+  std::string name;
+  uint64_t record;
+  uint64_t value;
+  uint64_t bytes;
+};
+
+static void
+usage ()
+{
+  fprintf (stderr, "Usage: %s [-j] [-n COUNT] FILE\n", progname);
+  exit (2);
+}
+
+static const char *
+kind_name (char tag)
+{
+  switch (tag)
+    {
+    case 'i': return "integer";
+    case 'f': return "real";
+    case 'p': return "pointer";
+    case 'q': return "qualified";
+    case '[': return "array";
+    case 'v': return "vector";
+    case 'c': return "complex";
+    case 'e': return "enum";
+    case '(': return "function";
+    case '{': return "struct";
+    case '|': return "union";
+    case 'S': return "symbol";
+    case 'M': return "macro";
+    case 'B': return "body";
+    case '?': return "unwritable";
+    case 'X': return "external";
+    default: return "unknown";
+    }
+}
+
+// Append STR to OUT as a JSON string.
+
+static void
+json_string (std::string *out, const std::string &str)
+{
+  out->push_back ('"');
+  for (unsigned char c : str)
+    {
+      if (c == '"' || c == '\\')
+	{
+	  out->push_back ('\\');
+	  out->push_back (c);
+	}
+      else if (c < 0x20)
+	{
+	  char buf[8];
+	  snprintf (buf, sizeof buf, "\\u%04x", c);
+	  out->append (buf);
+	}
+      else
+	out->push_back (c);
+    }
+  out->push_back ('"');
+}
+
+// Append the JSON member "KEY": VALUE, after a comma unless FIRST.
+
+static void
+json_number (std::string *out, const char *key, uint64_t value,
+	     bool first = false)
+{
+  char buf[64];
+  snprintf (buf, sizeof buf, "%s\"%s\": %llu", first ? "" : ", ", key,
+	    (unsigned long long) value);
+  out->append (buf);
+}
+
+static void
+json_bool (std::string *out, const char *key, bool value)
+{
+  *out += ", \"";
+  *out += key;
+  *out += value ? "\": true" : "\": false";
+}
+
+static void
+json_ranked (std::string *out, const char *key,
+	     const std::vector<ranked> &list, const char *value_key)
+{
+  *out += ",\n  \"";
+  *out += key;
+  *out += "\": [";
+  for (size_t i = 0; i < list.size (); ++i)
+    {
+      *out += i == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ";
+      json_string (out, list[i].name);
+      json_number (out, "record", list[i].record);
+      json_number (out, value_key, list[i].value);
+      json_number (out, "bytes", list[i].bytes);
+      out->push_back ('}');
+    }
+  *out += "]";
+}
+
+static void
+print_ranked (const char *title, const std::vector<ranked> &list,
+	      const char *value_title)
+{
+  if (list.empty ())
+    return;
+  printf ("\n%s:\n", title);
+  printf ("  %10s %10s %8s  %s\n", value_title, "bytes", "record", "name");
+  for (const ranked &r : list)
+    printf ("  %10llu %10llu %8llu  %s\n", (unsigned long long) r.value,
+	    (unsigned long long) r.bytes, (unsigned long long) r.record,
+	    r.name.c_str ());
+}
+
+// Sort LIST by decreasing value and keep the first COUNT entries.
+
+static void
+keep_largest (std::vector<ranked> *list, size_t count)
+{
+  std::stable_sort (list->begin (), list->end (),
+		    [] (const ranked &a, const ranked &b)
+		    {
+		      return a.value > b.value;
+		    });
+  if (list->size () > count)
+    list->resize (count);
+}
+
+// Count the entries of the string table, which is LENGTH bytes at
+// OFFSET in DATA, into STRINGS, keyed by contents.  Returns false if
+// it is malformed.
+
+static bool
+read_strings (const uint8_t *data, size_t offset, size_t length,
+	      std::map<std::string, size_t> *strings)
+{
+  size_t pos = 0;
+  while (pos < length)
+    {
+      if (length - pos < 5)
+	return false;
+      const char *start = (const char *) data + offset + pos + 4;
+      const char *end = (const char *) memchr (start, '\0',
+					       length - pos - 4);
+      if (end == nullptr)
+	return false;
+      ++(*strings)[std::string (start, end)];
+      pos += 4 + (end - start) + 1;
+    }
+  return true;
+}
+
+// Visit every record reachable from ID that has not been marked with
+// EPOCH yet, marking it, and add the number of records and bytes
+// visited to *COUNT and *BYTES.
+
+static void
+reach (const std::vector<record> &records, uint64_t id,
+       std::vector<size_t> *marks, size_t epoch, uint64_t *count,
+       uint64_t *bytes)
+{
+  std::vector<uint64_t> stack;
+  stack.push_back (id);
+  while (!stack.empty ())
+    {
+      uint64_t next = stack.back ();
+      stack.pop_back ();
+      if (next < NPCH_FIRST_RECORD)
+	continue;
+      size_t idx = next - NPCH_FIRST_RECORD;
+      if (idx >= records.size () || (*marks)[idx] == epoch)
+	continue;
+      (*marks)[idx] = epoch;
+      ++*count;
+      *bytes += records[idx].bytes;
+      for (const npch_field &field : records[idx].fields)
+	if (field.kind == NPCH_FIELD_REF)
+	  stack.push_back (field.value);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  bool json = false;
+  size_t top = 10;
+
+  int c;
+  while ((c = getopt (argc, argv, "jn:")) != -1)
+    {
+      switch (c)
+	{
+	case 'j':
+	  json = true;
+	  break;
+	case 'n':
+	  {
+	    char *end;
+	    top = strtoul (optarg, &end, 10);
+	    if (*optarg == '\0' || *end != '\0')
+	      usage ();
+	  }
+	  break;
+	default:
+	  usage ();
+	}
+    }
+  if (optind + 1 != argc)
+    usage ();
+  const char *filename = argv[optind];
+
+  mapped_file map;
+  if (!map.open (filename))
+    {
+      fprintf (stderr, "%s: %s: %s\n", progname, filename, strerror (errno));
+      return 1;
+    }
+  npch_file npch (map.data (), map.size ());
+  if (!npch.init ())
+    {
+      fprintf (stderr, "%s: %s: not a valid .npch file\n", progname,
+	       filename);
+      return 1;
+    }
+
+  std::string invalid;
+  bool checksum_ok = npch.validate (NPCH_VALIDATE_CHECKSUM, &invalid);
+  bool validated = (npch.flags () & NPCH_FLAG_VALIDATED) != 0;
+
+  std::vector<record> records (npch.num_records ());
+  for (size_t i = 0; i < records.size (); ++i)
+    {
+      const uint8_t *data = nullptr;
+      size_t length = 0;
+      bool ok = npch.get_record (NPCH_FIRST_RECORD + i, &data, &length);
+      const uint8_t *p = data;
+      if (!ok || !npch_parse_record (&p, data + length, &records[i].fields))
+	{
+	  fprintf (stderr, "%s: %s: record %zu is malformed\n", progname,
+		   filename, NPCH_FIRST_RECORD + i);
+	  return 1;
+	}
+      records[i].bytes = p - data;
+    }
+
+  std::vector<binding> bindings;
+  for (int dir = 0; dir < NPCH_NUM_DIRECTORIES; ++dir)
+    npch.for_each_entry (npch_directory (dir),
+			 [&] (uint32_t, const char *name, size_t len,
+			      uint32_t id)
+			 {
+			   bindings.push_back ({ npch_directory (dir),
+						 std::string (name, len),
+						 id });
+			 });
+
+  // Count and size the records of each kind.
+  std::map<char, std::pair<uint64_t, uint64_t>> kinds;
+  for (const record &r : records)
+    {
+      std::pair<uint64_t, uint64_t> &k = kinds[char (r.fields[0].value)];
+      ++k.first;
+      k.second += r.bytes;
+    }
+
+  // Aggregates are named by the tag directory, if at all.
+  std::unordered_map<uint64_t, std::string> tag_names;
+  for (const binding &b : bindings)
+    if (b.directory == NPCH_DIRECTORY_TAGS)
+      tag_names[b.record] = b.name;
+
+  std::vector<ranked> structs, enums;
+  for (size_t i = 0; i < records.size (); ++i)
+    {
+      const std::vector<npch_field> &fields = records[i].fields;
+      char tag = char (fields[0].value);
+      uint64_t id = NPCH_FIRST_RECORD + i;
+      auto name = tag_names.find (id);
+      ranked r = { name == tag_names.end () ? "<anonymous>" : name->second,
+		   id, 0, records[i].bytes };
+      if (tag == '{' || tag == '|')
+	{
+	  // Incomplete types have a size of -1.
+	  int64_t size = npch_unzigzag (fields[2].value);
+	  r.value = size < 0 ? 0 : size;
+	  structs.push_back (r);
+	}
+      else if (tag == 'e')
+	{
+	  r.value = npch_unzigzag (fields[2].value);
+	  enums.push_back (r);
+	}
+    }
+  keep_largest (&structs, top);
+  keep_largest (&enums, top);
+
+  // The fan-out of each symbol, and which records no name reaches.
+  std::vector<size_t> marks (records.size (), 0);
+  std::vector<ranked> fanout;
+  for (size_t i = 0; i < bindings.size (); ++i)
+    {
+      if (bindings[i].directory != NPCH_DIRECTORY_SYMBOLS)
+	continue;
+      ranked r = { bindings[i].name, bindings[i].record, 0, 0 };
+      reach (records, r.record, &marks, i + 1, &r.value, &r.bytes);
+      fanout.push_back (r);
+    }
+  keep_largest (&fanout, top);
+
+  uint64_t reachable = 0, reachable_bytes = 0;
+  std::fill (marks.begin (), marks.end (), 0);
+  for (const binding &b : bindings)
+    reach (records, b.record, &marks, 1, &reachable, &reachable_bytes);
+  uint64_t unreferenced = records.size () - reachable;
+  uint64_t unreferenced_bytes = 0;
+  for (size_t i = 0; i < records.size (); ++i)
+    if (marks[i] == 0)
+      unreferenced_bytes += records[i].bytes;
+
+  // The writer and npch-link both intern strings and share records,
+  // so any duplicates here are worth knowing about.
+  size_t offset, length;
+  npch.get_section (NPCH_SECTION_STRINGS, &offset, &length);
+  std::map<std::string, size_t> strings;
+  if (!read_strings (map.data (), offset, length, &strings))
+    {
+      fprintf (stderr, "%s: %s: the string table is malformed\n", progname,
+	       filename);
+      return 1;
+    }
+  uint64_t duplicate_strings = 0;
+  for (const auto &s : strings)
+    duplicate_strings += s.second - 1;
+
+  std::unordered_map<std::string, size_t> encodings;
+  uint64_t duplicate_records = 0, duplicate_record_bytes = 0;
+  for (const record &r : records)
+    {
+      std::string key;
+      npch_encode_record (r.fields, &key);
+      if (encodings[key]++ != 0)
+	{
+	  ++duplicate_records;
+	  duplicate_record_bytes += r.bytes;
+	}
+    }
+
+  uint64_t counts[NPCH_NUM_DIRECTORIES] = {};
+  for (const binding &b : bindings)
+    ++counts[b.directory];
+
+  if (json)
+    {
+      std::string out = "{";
+      json_number (&out, "file_bytes", map.size (), true);
+      json_bool (&out, "compressed",
+		 (npch.flags () & NPCH_FLAG_COMPRESSED) != 0);
+      json_bool (&out, "checksum_ok", checksum_ok);
+      json_bool (&out, "validated", validated);
+      out += ",\n  \"sections\": {";
+      for (int i = 0; i < NPCH_NUM_SECTIONS; ++i)
+	{
+	  npch.get_section (i, &offset, &length);
+	  json_number (&out, section_names[i], length, i == 0);
+	}
+      out += "},\n  \"names\": {";
+      for (int i = 0; i < NPCH_NUM_DIRECTORIES; ++i)
+	json_number (&out, directory_names[i], counts[i], i == 0);
+      out += "},\n  \"bases\": [";
+      for (size_t i = 0; i < npch.bases ().size (); ++i)
+	{
+	  if (i != 0)
+	    out += ", ";
+	  json_string (&out, npch.bases ()[i].path);
+	}
+      out += "],\n  \"records\": {";
+      json_number (&out, "count", records.size (), true);
+      json_number (&out, "unreferenced", unreferenced);
+      json_number (&out, "unreferenced_bytes", unreferenced_bytes);
+      json_number (&out, "duplicates", duplicate_records);
+      json_number (&out, "duplicate_bytes", duplicate_record_bytes);
+      out += "},\n  \"strings\": {";
+      json_number (&out, "count", strings.size () + duplicate_strings,
+		   true);
+      json_number (&out, "duplicates", duplicate_strings);
+      out += "},\n  \"kinds\": {";
+      bool first = true;
+      for (const auto &k : kinds)
+	{
+	  if (!first)
+	    out += ", ";
+	  first = false;
+	  json_string (&out, kind_name (k.first));
+	  out += ": {";
+	  json_number (&out, "count", k.second.first, true);
+	  json_number (&out, "bytes", k.second.second);
+	  out += "}";
+	}
+      out += "}";
+      json_ranked (&out, "largest_structs", structs, "size");
+      json_ranked (&out, "largest_enums", enums, "enumerators");
+      json_ranked (&out, "fanout", fanout, "records");
+      out += "\n}\n";
+      fputs (out.c_str (), stdout);
+      return 0;
+    }
+
+  printf ("%s: %zu bytes%s%s%s\n", filename, map.size (),
+	  (npch.flags () & NPCH_FLAG_COMPRESSED) ? ", compressed" : "",
+	  validated ? ", validated by the writer" : "",
+	  checksum_ok ? "" : ", checksum does not match");
+  printf ("\nSections:\n");
+  for (int i = 0; i < NPCH_NUM_SECTIONS; ++i)
+    {
+      npch.get_section (i, &offset, &length);
+      printf ("  %-10s %10zu\n", section_names[i], length);
+    }
+  printf ("\nNames:\n");
+  for (int i = 0; i < NPCH_NUM_DIRECTORIES; ++i)
+    printf ("  %-10s %10llu\n", directory_names[i],
+	    (unsigned long long) counts[i]);
+  if (!npch.bases ().empty ())
+    {
+      printf ("\nLayered on:\n");
+      for (const npch_base &base : npch.bases ())
+	printf ("  %s\n", base.path.c_str ());
+    }
+  printf ("\nRecords:\n  %-10s %10s %10s\n", "kind", "count", "bytes");
+  for (const auto &k : kinds)
+    printf ("  %-10s %10llu %10llu\n", kind_name (k.first),
+	    (unsigned long long) k.second.first,
+	    (unsigned long long) k.second.second);
+  printf ("  %-10s %10zu\n", "total", records.size ());
+  printf ("  %llu unreferenced (%llu bytes), %llu duplicated"
+	  " (%llu bytes)\n",
+	  (unsigned long long) unreferenced,
+	  (unsigned long long) unreferenced_bytes,
+	  (unsigned long long) duplicate_records,
+	  (unsigned long long) duplicate_record_bytes);
+  printf ("\nStrings: %zu, %llu duplicated\n",
+	  strings.size () + duplicate_strings,
+	  (unsigned long long) duplicate_strings);
+
+  print_ranked ("Largest structs and unions", structs, "size");
+  print_ranked ("Largest enums", enums, "enumerators");
+  print_ranked ("Symbols reaching the most records", fanout, "records");
+  return 0;
+}
@@ -0,0 +1,414 @@
+// npch-link - merge several .npch files into one.
+//
+// Usage: npch-link [-z LEVEL] [-d first|warn|error] -o OUTPUT INPUT...
+//
+// The output has a single symbol and tag directory, and holds each
+// distinct record once, so a compilation can import one file instead
+// of many overlapping ones.  When two inputs bind a name to
+// different records, the first input wins; -d chooses whether this
+// is silent, a warning (the default), or an error.
+
+#include "builder.hh"
+#include "format.hh"
+#include "mapfile.hh"
+#include "npchfile.hh"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static const char *progname = "npch-link";
+
+enum conflict_policy
+{
+  CONFLICTS_FIRST,
+  CONFLICTS_WARN,
+  CONFLICTS_ERROR
+};
+
+struct input
+{
+  const char *filename;
+  std::unique_ptr<mapped_file> map;
+  std::unique_ptr<npch_file> npch;
+  // The index of the first record of this input among all records.
+  size_t base;
+};
+
+// A record of some input, with its names already interned in the
+// output and its references renumbered to index all records.
+struct node
+{
+  std::vector<npch_field> fields;
+  // The input this came from.
+  size_t input;
+};
+
+static void
+usage ()
+{
+  fprintf (stderr, "Usage: %s [-z LEVEL] [-d first|warn|error] "
+	   "-o OUTPUT INPUT...\n", progname);
+  exit (2);
+}
+
+// Append VAL to KEY as a varint.
+
+static void
+add_key (std::string *key, uint64_t val)
+{
+  uint8_t buf[NPCH_MAX_VARINT];
+  size_t n = npch_encode_uint (buf, val);
+  key->append (reinterpret_cast<const char *> (buf), n);
+}
+
+// True if FIELDS is a struct, union or enum record.  These have an
+// identity of their own, unlike the other records.
+static bool
+aggregate_p (const std::vector<npch_field> &fields)
+{
+  char tag = fields[0].value;
+  return tag == '{' || tag == '|' || tag == 'e';
+}
+
+// Read every record of IN into NODES, interning names in BUILDER.
+// Record the tag name of each aggregate in TAG_NAMES.  The bases of
+// IN become bases of the output.
+
+static bool
+read_input (input &in, size_t which, npch_builder *builder,
+	    std::vector<node> *nodes, std::vector<uint32_t> *tag_names)
+{
+  npch_file &npch = *in.npch;
+  in.base = nodes->size ();
+  size_t n_records = npch.num_records ();
+
+  std::vector<uint32_t> bases;
+  for (const npch_base &base : npch.bases ())
+    bases.push_back (builder->add_base (base.path, base.checksum));
+
+  for (size_t i = 0; i < n_records; ++i)
+    {
+      const uint8_t *data;
+      size_t length;
+      node n;
+      n.input = which;
+      if (!npch.get_record (NPCH_FIRST_RECORD + i, &data, &length)
+	  || !npch_parse_record (&data, data + length, &n.fields))
+	return false;
+
+      for (npch_field &field : n.fields)
+	{
+	  if (field.kind == NPCH_FIELD_NAME)
+	    {
+	      const char *str;
+	      size_t len;
+	      uint32_t hash;
+	      if (!npch.get_string (field.value, &str, &len, &hash))
+		return false;
+	      field.value = builder->intern (str, len, hash);
+	    }
+	  else if (field.kind == NPCH_FIELD_REF
+		   && field.value >= NPCH_FIRST_RECORD)
+	    {
+	      if (field.value - NPCH_FIRST_RECORD >= n_records)
+		return false;
+	      field.value += in.base;
+	    }
+	}
+      // Renumber the base that a reference into another file is to.
+      if (n.fields[0].value == 'X')
+	{
+	  if (n.fields[1].value >= bases.size ())
+	    return false;
+	  n.fields[1].value = bases[n.fields[1].value];
+	}
+      nodes->push_back (std::move (n));
+    }
+
+  tag_names->resize (nodes->size (), 0);
+  bool ok = true;
+  npch.for_each_entry (NPCH_DIRECTORY_TAGS,
+		       [&] (uint32_t hash, const char *name, size_t len,
+			    uint32_t record)
+		       {
+			 if (record < NPCH_FIRST_RECORD
+			     || record - NPCH_FIRST_RECORD >= n_records)
+			   {
+			     ok = false;
+			     return;
+			   }
+			 (*tag_names)[in.base + record - NPCH_FIRST_RECORD]
+			   = builder->intern (name, len, hash);
+		       });
+  return ok;
+}
+
+// Partition NODES into classes of identical records, setting
+// CLASSES[I] to the class of node I.  Returns the number of classes.
+//
+// This is partition refinement, as in DFA minimization: start from
+// the contents of each record with its references blanked out, then
+// repeatedly split classes whose members refer to different classes,
+// until nothing changes.  This merges identical records even when
+// they refer to each other in cycles, as structs often do.
+//
+// Aggregates are only merged when they have the same tag, and never
+// with another aggregate of the same input; across inputs, this is
+// the C rule for compatible types in different translation units.
+
+static size_t
+partition (const std::vector<node> &nodes,
+	   const std::vector<uint32_t> &tag_names,
+	   std::vector<size_t> *classes)
+{
+  size_t n = nodes.size ();
+  std::vector<size_t> &cls = *classes;
+  cls.resize (n);
+
+  std::unordered_map<std::string, size_t> keys;
+  // For each input, how many aggregates with a given key it has.
+  std::unordered_map<std::string, size_t> seen;
+  for (size_t i = 0; i < n; ++i)
+    {
+      std::string key;
+      for (const npch_field &field : nodes[i].fields)
+	{
+	  key.push_back (char (field.kind));
+	  if (field.kind == NPCH_FIELD_REF && field.value >= NPCH_FIRST_RECORD)
+	    add_key (&key, 0);
+	  else
+	    add_key (&key, field.value);
+	}
+
+      if (aggregate_p (nodes[i].fields))
+	{
+	  add_key (&key, tag_names[i]);
+	  std::string input_key = key;
+	  add_key (&input_key, nodes[i].input);
+	  add_key (&key, seen[input_key]++);
+	}
+
+      cls[i] = keys.emplace (key, keys.size ()).first->second;
+    }
+
+  size_t n_classes = keys.size ();
+  std::vector<size_t> next (n);
+  while (true)
+    {
+      std::unordered_map<std::string, size_t> sigs;
+      for (size_t i = 0; i < n; ++i)
+	{
+	  std::string sig;
+	  add_key (&sig, cls[i]);
+	  for (const npch_field &field : nodes[i].fields)
+	    if (field.kind == NPCH_FIELD_REF
+		&& field.value >= NPCH_FIRST_RECORD)
+	      add_key (&sig, cls[field.value - NPCH_FIRST_RECORD]);
+	  next[i] = sigs.emplace (sig, sigs.size ()).first->second;
+	}
+
+      // Refinement only ever splits classes, so if the count is the
+      // same, so is the partition.
+      if (sigs.size () == n_classes)
+	break;
+      n_classes = sigs.size ();
+      cls.swap (next);
+    }
+
+  return n_classes;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *output = nullptr;
+  int compression = -1;
+  conflict_policy conflicts = CONFLICTS_WARN;
+
+  int c;
+  while ((c = getopt (argc, argv, "o:z:d:")) != -1)
+    {
+      switch (c)
+	{
+	case 'o':
+	  output = optarg;
+	  break;
+	case 'z':
+	  if (optarg[0] < '0' || optarg[0] > '9' || optarg[1] != '\0')
+	    usage ();
+	  compression = optarg[0] - '0';
+	  break;
+	case 'd':
+	  if (strcmp (optarg, "first") == 0)
+	    conflicts = CONFLICTS_FIRST;
+	  else if (strcmp (optarg, "warn") == 0)
+	    conflicts = CONFLICTS_WARN;
+	  else if (strcmp (optarg, "error") == 0)
+	    conflicts = CONFLICTS_ERROR;
+	  else
+	    usage ();
+	  break;
+	default:
+	  usage ();
+	}
+    }
+  if (output == nullptr || optind == argc)
+    usage ();
+
+  npch_builder builder;
+  std::vector<input> inputs (argc - optind);
+  std::vector<node> nodes;
+  std::vector<uint32_t> tag_names;
+  // The input that first named each base, and the base's checksum.
+  std::unordered_map<std::string, std::pair<size_t, uint64_t>> bases;
+  for (size_t i = 0; i < inputs.size (); ++i)
+    {
+      input &in = inputs[i];
+      in.filename = argv[optind + i];
+      in.map.reset (new mapped_file ());
+      if (!in.map->open (in.filename))
+	{
+	  fprintf (stderr, "%s: %s: %s\n", progname, in.filename,
+		   strerror (errno));
+	  return 1;
+	}
+      in.npch.reset (new npch_file (in.map->data (), in.map->size ()));
+      if (!in.npch->init ()
+	  || !read_input (in, i, &builder, &nodes, &tag_names))
+	{
+	  fprintf (stderr, "%s: %s: not a valid .npch file\n", progname,
+		   in.filename);
+	  return 1;
+	}
+
+      // The 'X' records of inputs layered on different versions of
+      // the same base cannot all be right for the file on disk.
+      for (const npch_base &base : in.npch->bases ())
+	{
+	  auto found = bases.emplace (base.path,
+				      std::make_pair (i, base.checksum));
+	  if (!found.second && found.first->second.second != base.checksum)
+	    {
+	      fprintf (stderr, "%s: %s and %s are layered on different "
+		       "versions of %s\n", progname,
+		       inputs[found.first->second.first].filename,
+		       in.filename, base.path.c_str ());
+	      return 1;
+	    }
+	}
+    }
+
+  // The output depends on everything the inputs depend on.  Records
+  // built for different targets cannot be mixed.
+  std::string config;
+  for (size_t i = 0; i < inputs.size (); ++i)
+    {
+      std::string input_config;
+      std::vector<npch_dependency> deps;
+      if (!inputs[i].npch->get_manifest (&input_config, &deps))
+	{
+	  fprintf (stderr, "%s: %s: not a valid .npch file\n", progname,
+		   inputs[i].filename);
+	  return 1;
+	}
+      if (i == 0)
+	config = input_config;
+      else if (input_config != config)
+	{
+	  fprintf (stderr, "%s: %s: built with a different compiler "
+		   "configuration than %s\n", progname, inputs[i].filename,
+		   inputs[0].filename);
+	  return 1;
+	}
+      for (const npch_dependency &dep : deps)
+	builder.add_dependency (dep);
+    }
+  builder.set_config (config);
+
+  std::vector<size_t> classes;
+  size_t n_classes = partition (nodes, tag_names, &classes);
+
+  // Number the classes in order of their first member.  All IDs
+  // must be known before any record can be written, since records
+  // refer forwards as well as backwards.
+  std::vector<uint64_t> ids (n_classes, 0);
+  uint64_t next_id = NPCH_FIRST_RECORD;
+  for (size_t i = 0; i < nodes.size (); ++i)
+    if (ids[classes[i]] == 0)
+      ids[classes[i]] = next_id++;
+
+  // Write the first member of each class as its record, in ID order.
+  std::vector<size_t> record_offsets;
+  std::string pool;
+  for (size_t i = 0; i < nodes.size (); ++i)
+    {
+      if (ids[classes[i]] != NPCH_FIRST_RECORD + record_offsets.size ())
+	continue;
+      record_offsets.push_back (pool.size ());
+
+      std::vector<npch_field> fields = nodes[i].fields;
+      for (npch_field &field : fields)
+	if (field.kind == NPCH_FIELD_REF && field.value >= NPCH_FIRST_RECORD)
+	  field.value = ids[classes[field.value - NPCH_FIRST_RECORD]];
+      npch_encode_record (fields, &pool);
+    }
+
+  // Merge the directories.  The first input to bind a name wins.
+  static const char *const kinds[NPCH_NUM_DIRECTORIES] =
+  {
+    "symbol", "tag", "macro"
+  };
+  bool failed = false;
+  for (int dir = 0; dir < NPCH_NUM_DIRECTORIES; ++dir)
+    {
+      npch_directory which = npch_directory (dir);
+      // The output record and the input of each bound name.
+      std::unordered_map<uint32_t, std::pair<uint64_t, size_t>> bound;
+      for (size_t i = 0; i < inputs.size (); ++i)
+	inputs[i].npch->for_each_entry
+	  (which,
+	   [&] (uint32_t hash, const char *name, size_t len, uint32_t record)
+	   {
+	     uint64_t id = record;
+	     if (record >= NPCH_FIRST_RECORD)
+	       id = ids[classes[inputs[i].base + record - NPCH_FIRST_RECORD]];
+	     uint32_t ref = builder.intern (name, len, hash);
+	     auto result = bound.emplace (ref, std::make_pair (id, i));
+	     if (result.second)
+	       {
+		 builder.add_entry (which, ref, id);
+		 return;
+	       }
+
+	     const std::pair<uint64_t, size_t> &prev = result.first->second;
+	     if (prev.first == id || conflicts == CONFLICTS_FIRST)
+	       return;
+	     fprintf (stderr, "%s: %s: %s %s '%.*s' conflicts with %s\n",
+		      progname, inputs[i].filename,
+		      conflicts == CONFLICTS_ERROR ? "error:" : "warning:",
+		      kinds[which], int (len), name,
+		      inputs[prev.second].filename);
+	     if (conflicts == CONFLICTS_ERROR)
+	       failed = true;
+	   });
+    }
+  if (failed)
+    return 1;
+
+  if (!builder.write (output, pool.data (), pool.size (), record_offsets,
+		      compression))
+    {
+      fprintf (stderr, "%s: %s: %s\n", progname, output, strerror (errno));
+      return 1;
+    }
+  if (!builder.unvalidated ().empty ())
+    fprintf (stderr, "%s: warning: %s is not marked as validated: %s\n",
+	     progname, output, builder.unvalidated ().c_str ());
+  return 0;
+}
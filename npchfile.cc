@@ -0,0 +1,797 @@
+// Read the contents of a .npch file.
+
+#include "npchfile.hh"
+#include "version.hh"
+#include "mapfile.hh"
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+npch_file::npch_file (const uint8_t *data, size_t length)
+  : m_data (data),
+    m_length (length),
+    m_flags (0),
+    m_trusted (false),
+    m_n_records (0),
+    m_pool_length (0),
+    m_n_blocks (0)
+{
+}
+
+bool
+npch_file::init ()
+{
+  if (m_length < NPCH_HEADER_SIZE
+      || npch_get_u32 (m_data) != PCH_PLUGIN_VERSION)
+    return false;
+  m_flags = npch_get_u32 (m_data + 4);
+
+  for (int i = 0; i < NPCH_NUM_SECTIONS; ++i)
+    {
+      const uint8_t *entry = m_data + 16 + 16 * i;
+      uint64_t start = npch_get_u64 (entry);
+      uint64_t size = npch_get_u64 (entry + 8);
+      if (start > m_length || size > m_length - start)
+	return false;
+      m_sections[i].offset = start;
+      m_sections[i].length = size;
+    }
+
+  const section &filters = m_sections[NPCH_SECTION_FILTERS];
+  const uint8_t *p = m_data + filters.offset;
+  const uint8_t *end = p + filters.length;
+  for (int i = 0; i < NPCH_NUM_DIRECTORIES; ++i)
+    if (!init_directory (i, &m_directories[i])
+	|| !init_filter (&p, end, &m_directories[i]))
+      return false;
+
+  m_strings = m_data + m_sections[NPCH_SECTION_STRINGS].offset;
+  m_strings_length = m_sections[NPCH_SECTION_STRINGS].length;
+
+  m_offset_width = (m_flags & NPCH_FLAG_WIDE_OFFSETS) ? 8 : 4;
+  m_record_offsets = m_data + m_sections[NPCH_SECTION_RECORDS].offset;
+  m_n_records = m_sections[NPCH_SECTION_RECORDS].length / m_offset_width;
+
+  m_pool = m_data + m_sections[NPCH_SECTION_POOL].offset;
+  return init_blocks () && init_bases ();
+}
+
+bool
+npch_file::init_bases ()
+{
+  const section &bases = m_sections[NPCH_SECTION_BASES];
+  if (bases.length == 0)
+    return true;
+  const uint8_t *p = m_data + bases.offset;
+  const uint8_t *end = p + bases.length;
+  if (end - p < 4)
+    return false;
+  uint32_t count = npch_get_u32 (p);
+  p += 4;
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      if (end - p < 12)
+	return false;
+      npch_base base;
+      base.checksum = npch_get_u64 (p);
+      uint32_t len = npch_get_u32 (p + 8);
+      p += 12;
+      if (size_t (end - p) < len)
+	return false;
+      base.path.assign (reinterpret_cast<const char *> (p), len);
+      p += len;
+      m_bases.push_back (std::move (base));
+    }
+  return true;
+}
+
+bool
+npch_file::init_directory (int which, directory *result)
+{
+  const section &sect = m_sections[which];
+  if (sect.length < 4)
+    return false;
+
+  result->start = m_data + sect.offset;
+  result->log2 = npch_get_u32 (result->start);
+  return (result->log2 > 0 && result->log2 < 32
+	  && ((size_t (NPCH_BUCKET_SIZE) << result->log2)
+	      <= sect.length - 4));
+}
+
+bool
+npch_file::init_filter (const uint8_t **p, const uint8_t *end,
+			directory *result)
+{
+  if (end - *p < 4)
+    return false;
+  result->filter_log2 = npch_get_u32 (*p);
+  if (result->filter_log2 < NPCH_FILTER_MIN_LOG2 || result->filter_log2 >= 32)
+    return false;
+  size_t size = (size_t (1) << result->filter_log2) / 8;
+  if (size > size_t (end - *p) - 4)
+    return false;
+  result->filter = *p + 4;
+  *p += 4 + size;
+  return true;
+}
+
+// Check the block table of a compressed pool.
+
+bool
+npch_file::init_blocks ()
+{
+  const section &blocks = m_sections[NPCH_SECTION_BLOCKS];
+  const section &pool = m_sections[NPCH_SECTION_POOL];
+  if (blocks.length % NPCH_BLOCK_ENTRY_SIZE != 0)
+    return false;
+  m_blocks = m_data + blocks.offset;
+  m_n_blocks = blocks.length / NPCH_BLOCK_ENTRY_SIZE;
+
+  if ((m_flags & NPCH_FLAG_COMPRESSED) == 0)
+    {
+      m_pool_length = pool.length;
+      return m_n_blocks == 0;
+    }
+
+  // Everything else trusts the table, so check it here.
+  m_pool_length = 0;
+  for (size_t i = 0; i < m_n_blocks; ++i)
+    {
+      const uint8_t *entry = m_blocks + i * NPCH_BLOCK_ENTRY_SIZE;
+      uint64_t data_offset = npch_get_u64 (entry + 8);
+      uint32_t length = npch_get_u32 (entry + 16);
+      uint32_t compressed_length = npch_get_u32 (entry + 20);
+      if (npch_get_u64 (entry) != m_pool_length
+	  || length == 0
+	  || compressed_length > length
+	  || data_offset > pool.length
+	  || compressed_length > pool.length - data_offset)
+	return false;
+      m_pool_length += length;
+    }
+
+  m_block_cache.resize (m_n_blocks);
+  return m_n_blocks > 0;
+}
+
+bool
+npch_file::get_string (uint64_t ref, const char **str, size_t *len,
+		       uint32_t *hash) const
+{
+  if (ref >= m_strings_length || m_strings_length - ref < 5)
+    return false;
+  const char *start = (const char *) m_strings + ref + 4;
+  const char *end = (const char *) memchr (start, '\0',
+					   m_strings_length - ref - 4);
+  if (end == nullptr)
+    return false;
+
+  *str = start;
+  *len = end - start;
+  *hash = npch_get_u32 (m_strings + ref);
+  return true;
+}
+
+bool
+npch_file::lookup (npch_directory which, uint32_t hash, const char *name,
+		   size_t len, uint64_t *record) const
+{
+  const directory &dir = m_directories[which];
+  uint32_t mask = (uint32_t (1) << dir.log2) - 1;
+  const uint8_t *buckets = dir.start + 4;
+
+  // Nearly every query misses, so try to reject it without touching
+  // the table.
+  if (!npch_filter_test (dir.filter, dir.filter_log2, hash))
+    return false;
+
+  uint32_t i = npch_first_bucket (hash, dir.log2);
+  for (uint32_t n = 0; n <= mask; ++n, i = (i + 1) & mask)
+    {
+      const uint8_t *bucket = buckets + i * NPCH_BUCKET_SIZE;
+      uint32_t name_ref = npch_get_u32 (bucket + 4);
+      if (name_ref == 0)
+	break;
+      if (npch_get_u32 (bucket) != hash)
+	continue;
+
+      const char *str;
+      size_t str_len;
+      uint32_t str_hash;
+      if (get_string (name_ref, &str, &str_len, &str_hash)
+	  && str_len == len && memcmp (str, name, len) == 0)
+	{
+	  *record = npch_get_u32 (bucket + 8);
+	  return true;
+	}
+    }
+
+  return false;
+}
+
+void
+npch_file::for_each_entry (npch_directory which,
+			   const std::function<void (uint32_t, const char *,
+						     size_t, uint32_t)> &fn)
+  const
+{
+  const directory &dir = m_directories[which];
+  const uint8_t *buckets = dir.start + 4;
+  size_t n_buckets = size_t (1) << dir.log2;
+
+  for (size_t i = 0; i < n_buckets; ++i)
+    {
+      const uint8_t *bucket = buckets + i * NPCH_BUCKET_SIZE;
+      const char *name;
+      size_t len;
+      uint32_t hash;
+      if (npch_get_u32 (bucket + 4) == 0
+	  || !get_string (npch_get_u32 (bucket + 4), &name, &len, &hash))
+	continue;
+      fn (hash, name, len, npch_get_u32 (bucket + 8));
+    }
+}
+
+bool
+npch_stat_dependency (const char *path, npch_dependency *dep, bool hash)
+{
+  struct stat sbuf;
+  if (stat (path, &sbuf) != 0)
+    return false;
+
+  dep->path = path;
+  dep->size = sbuf.st_size;
+  dep->mtime = (uint64_t (sbuf.st_mtim.tv_sec) * 1000000000
+		+ sbuf.st_mtim.tv_nsec);
+  dep->hash = NPCH_HASH_BYTES_INIT;
+  if (hash && sbuf.st_size > 0)
+    {
+      mapped_file contents;
+      if (!contents.open (path))
+	return false;
+      contents.advise (mapped_file::ACCESS_SEQUENTIAL);
+      dep->hash = npch_hash_bytes (contents.data (), contents.size ());
+    }
+  return true;
+}
+
+bool
+npch_file::get_manifest (std::string *config,
+			 std::vector<npch_dependency> *deps) const
+{
+  const section &manifest = m_sections[NPCH_SECTION_MANIFEST];
+  const uint8_t *p = m_data + manifest.offset;
+  const uint8_t *end = p + manifest.length;
+
+  if (end - p < 4)
+    return false;
+  uint32_t len = npch_get_u32 (p);
+  p += 4;
+  if (size_t (end - p) < len + size_t (4))
+    return false;
+  config->assign (reinterpret_cast<const char *> (p), len);
+  p += len;
+
+  uint32_t count = npch_get_u32 (p);
+  p += 4;
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      if (end - p < 28)
+	return false;
+      npch_dependency dep;
+      dep.size = npch_get_u64 (p);
+      dep.mtime = npch_get_u64 (p + 8);
+      dep.hash = npch_get_u64 (p + 16);
+      len = npch_get_u32 (p + 24);
+      p += 28;
+      if (size_t (end - p) < len)
+	return false;
+      dep.path.assign (reinterpret_cast<const char *> (p), len);
+      p += len;
+      deps->push_back (std::move (dep));
+    }
+  return true;
+}
+
+bool
+npch_file::check_manifest (const std::string &config,
+			   std::string *reason) const
+{
+  std::string file_config;
+  std::vector<npch_dependency> deps;
+  if (!get_manifest (&file_config, &deps))
+    {
+      *reason = "its manifest is corrupt";
+      return false;
+    }
+  if (file_config != config)
+    {
+      *reason = "it was built with a different compiler configuration";
+      return false;
+    }
+
+  // Checking the size and time is nearly free; only hash a file when
+  // these do not match, as after a touch or a checkout.
+  for (const npch_dependency &dep : deps)
+    {
+      npch_dependency now;
+      if (!npch_stat_dependency (dep.path.c_str (), &now, false))
+	{
+	  *reason = "'" + dep.path + "': " + strerror (errno);
+	  return false;
+	}
+      if (now.size == dep.size && now.mtime == dep.mtime)
+	continue;
+      if (now.size != dep.size
+	  || !npch_stat_dependency (dep.path.c_str (), &now, true)
+	  || now.hash != dep.hash)
+	{
+	  *reason = "'" + dep.path + "' has changed";
+	  return false;
+	}
+    }
+  return true;
+}
+
+bool
+npch_file::validate (npch_validation mode, std::string *reason)
+{
+  if (mode == NPCH_VALIDATE_NONE)
+    return true;
+
+  if (mode == NPCH_VALIDATE_CHECKSUM)
+    {
+      uint64_t hash = npch_hash_bytes (m_data, NPCH_CHECKSUM_OFFSET);
+      hash = npch_hash_bytes (m_data + NPCH_CHECKSUM_OFFSET + 8,
+			      m_length - NPCH_CHECKSUM_OFFSET - 8, hash);
+      if (hash != npch_get_u64 (m_data + NPCH_CHECKSUM_OFFSET))
+	{
+	  *reason = "the checksum does not match";
+	  return false;
+	}
+      m_trusted = (m_flags & NPCH_FLAG_VALIDATED) != 0;
+      return true;
+    }
+
+  std::vector<npch_field> fields;
+  for (size_t i = 0; i < m_n_records; ++i)
+    {
+      const uint8_t *data;
+      size_t length;
+      if (!get_record (NPCH_FIRST_RECORD + i, &data, &length)
+	  || !npch_check_record (data, length, m_n_records,
+				 m_strings_length, m_bases.size (), &fields))
+	{
+	  *reason = "record " + std::to_string (NPCH_FIRST_RECORD + i)
+	    + " is malformed";
+	  return false;
+	}
+    }
+
+  bool ok = true;
+  for (int i = 0; i < NPCH_NUM_DIRECTORIES; ++i)
+    for_each_entry (npch_directory (i),
+		    [&] (uint32_t, const char *, size_t, uint32_t record)
+		    {
+		      if (record >= NPCH_FIRST_RECORD
+			  && record - NPCH_FIRST_RECORD >= m_n_records)
+			ok = false;
+		    });
+  if (!ok)
+    {
+      *reason = "a name is bound to a record that does not exist";
+      return false;
+    }
+
+  m_trusted = true;
+  return true;
+}
+
+// Find the bytes of the pool holding the record at OFFSET in the
+// uncompressed pool.  On success, set *DATA and *LENGTH to the block
+// that holds it, inflating the block if needed, and *START to the
+// uncompressed offset of the block.
+
+bool
+npch_file::get_block (uint64_t offset, const uint8_t **data,
+		      size_t *length, uint64_t *start)
+{
+  if (offset >= m_pool_length)
+    return false;
+
+  if (m_n_blocks == 0)
+    {
+      *data = m_pool;
+      *length = m_pool_length;
+      *start = 0;
+      return true;
+    }
+
+  // Find the last block starting at or before OFFSET.
+  size_t lo = 0, hi = m_n_blocks;
+  while (hi - lo > 1)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (npch_get_u64 (m_blocks + mid * NPCH_BLOCK_ENTRY_SIZE) <= offset)
+	lo = mid;
+      else
+	hi = mid;
+    }
+
+  const uint8_t *entry = m_blocks + lo * NPCH_BLOCK_ENTRY_SIZE;
+  *start = npch_get_u64 (entry);
+  *length = npch_get_u32 (entry + 16);
+  const uint8_t *compressed = m_pool + npch_get_u64 (entry + 8);
+  size_t compressed_length = npch_get_u32 (entry + 20);
+  if (compressed_length == *length)
+    {
+      *data = compressed;
+      return true;
+    }
+
+  if (!m_block_cache[lo])
+    {
+      std::unique_ptr<uint8_t[]> block (new uint8_t[*length]);
+      z_stream stream;
+      memset (&stream, 0, sizeof (stream));
+      if (inflateInit (&stream) != Z_OK)
+	return false;
+      stream.next_in = const_cast<Bytef *> (compressed);
+      stream.avail_in = compressed_length;
+      stream.next_out = block.get ();
+      stream.avail_out = *length;
+      int result = inflate (&stream, Z_FINISH);
+      bool ok = result == Z_STREAM_END && stream.total_out == *length;
+      inflateEnd (&stream);
+      if (!ok)
+	return false;
+      m_block_cache[lo] = std::move (block);
+    }
+
+  *data = m_block_cache[lo].get ();
+  return true;
+}
+
+bool
+npch_file::get_record (uint64_t id, const uint8_t **data, size_t *length)
+{
+  if (id < NPCH_FIRST_RECORD || id - NPCH_FIRST_RECORD >= m_n_records)
+    return false;
+
+  const uint8_t *entry = (m_record_offsets
+			  + m_offset_width * (id - NPCH_FIRST_RECORD));
+  uint64_t offset = (m_offset_width == 8 ? npch_get_u64 (entry)
+		     : npch_get_u32 (entry));
+  const uint8_t *block;
+  size_t block_length;
+  uint64_t start;
+  if (!get_block (offset, &block, &block_length, &start))
+    return false;
+  *data = block + (offset - start);
+  *length = block_length - (offset - start);
+  return true;
+}
+
+// Read one integer field of kind KIND.
+
+static bool
+parse_int (const uint8_t **p, const uint8_t *end, npch_field_kind kind,
+	   std::vector<npch_field> *fields, uint64_t *result = nullptr)
+{
+  npch_field field;
+  field.kind = kind;
+  if (!npch_decode_uint (p, end, &field.value))
+    return false;
+  fields->push_back (field);
+  if (result != nullptr)
+    *result = field.value;
+  return true;
+}
+
+static bool
+parse_byte (const uint8_t **p, const uint8_t *end,
+	    std::vector<npch_field> *fields, char *result = nullptr)
+{
+  if (*p >= end)
+    return false;
+  npch_field field;
+  field.kind = NPCH_FIELD_BYTE;
+  field.value = *(*p)++;
+  fields->push_back (field);
+  if (result != nullptr)
+    *result = field.value;
+  return true;
+}
+
+// Read a location; see hash_writer::emit_location.
+
+static bool
+parse_location (const uint8_t **p, const uint8_t *end,
+		std::vector<npch_field> *fields)
+{
+  return (parse_int (p, end, NPCH_FIELD_NAME, fields)
+	  && parse_int (p, end, NPCH_FIELD_INT, fields));
+}
+
+// Read an attribute list; see hash_writer::emit_attributes.
+
+static bool
+parse_attributes (const uint8_t **p, const uint8_t *end,
+		  std::vector<npch_field> *fields)
+{
+  uint64_t count, n_args;
+  if (!parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+    return false;
+  for (int64_t n = npch_unzigzag (count); n > 0; --n)
+    {
+      if (!parse_int (p, end, NPCH_FIELD_NAME, fields)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields, &n_args))
+	return false;
+      for (int64_t i = npch_unzigzag (n_args); i > 0; --i)
+	{
+	  char kind;
+	  if (!parse_byte (p, end, fields, &kind))
+	    return false;
+	  if (kind == 'i')
+	    {
+	      if (!parse_int (p, end, NPCH_FIELD_INT, fields))
+		return false;
+	    }
+	  else if (kind == 's' || kind == 'n')
+	    {
+	      if (!parse_int (p, end, NPCH_FIELD_NAME, fields))
+		return false;
+	    }
+	  else
+	    return false;
+	}
+    }
+  return true;
+}
+
+// Read the node of a function body starting at *P, and everything
+// under it; see hash_writer::write_body.  DEPTH is how deeply it is
+// nested; see NPCH_MAX_ITEM_DEPTH.
+
+static bool
+parse_item (const uint8_t **p, const uint8_t *end,
+	    std::vector<npch_field> *fields, unsigned depth)
+{
+  char kind;
+  uint64_t count, flags;
+  if (depth >= NPCH_MAX_ITEM_DEPTH || !parse_byte (p, end, fields, &kind))
+    return false;
+
+  switch (kind)
+    {
+    case 'N':
+      return true;
+
+    case 'x':
+      return parse_int (p, end, NPCH_FIELD_INT, fields);
+
+    case 'G':
+      return parse_int (p, end, NPCH_FIELD_NAME, fields);
+
+    case 'F':
+    case 'I':
+      return (parse_int (p, end, NPCH_FIELD_REF, fields)
+	      && parse_int (p, end, NPCH_FIELD_INT, fields));
+
+    case 'R':
+      return (parse_int (p, end, NPCH_FIELD_REF, fields)
+	      && parse_int (p, end, NPCH_FIELD_NAME, fields));
+
+    case 'T':
+      if (!parse_int (p, end, NPCH_FIELD_REF, fields)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_byte (p, end, fields))
+	  return false;
+      return true;
+
+    case 'D':
+      return (parse_int (p, end, NPCH_FIELD_INT, fields)
+	      && parse_int (p, end, NPCH_FIELD_INT, fields)
+	      && parse_int (p, end, NPCH_FIELD_NAME, fields)
+	      && parse_int (p, end, NPCH_FIELD_REF, fields)
+	      && parse_location (p, end, fields)
+	      && parse_item (p, end, fields, depth + 1));
+
+    case 'L':
+      if (!parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_item (p, end, fields, depth + 1))
+	  return false;
+      return true;
+
+    case 'E':
+    case 'b':
+      if ((kind == 'E' && !parse_int (p, end, NPCH_FIELD_INT, fields))
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields, &flags))
+	return false;
+      if ((npch_unzigzag (flags) & NPCH_NODE_HAS_TYPE) != 0
+	  && !parse_int (p, end, NPCH_FIELD_REF, fields))
+	return false;
+      if (!parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_item (p, end, fields, depth + 1))
+	  return false;
+      // The variables of a BIND_EXPR are followed by its body.
+      return kind == 'E' || parse_item (p, end, fields, depth + 1);
+    }
+
+  return false;
+}
+
+// This must agree with the writer and with the read_* functions of
+// mapped_hash.
+
+bool
+npch_parse_record (const uint8_t **p, const uint8_t *end,
+		   std::vector<npch_field> *fields)
+{
+  char tag;
+  uint64_t count;
+  if (!parse_byte (p, end, fields, &tag))
+    return false;
+
+  switch (tag)
+    {
+    case 'i':
+    case 'f':
+      return parse_int (p, end, NPCH_FIELD_INT, fields);
+
+    case 'p':
+    case 'c':
+      return parse_int (p, end, NPCH_FIELD_REF, fields);
+
+    case '?':
+      return true;
+
+    case 'X':
+      return (parse_int (p, end, NPCH_FIELD_INT, fields)
+	      && parse_int (p, end, NPCH_FIELD_INT, fields));
+
+    case 'q':
+    case '[':
+    case 'v':
+      return (parse_int (p, end, NPCH_FIELD_INT, fields)
+	      && parse_int (p, end, NPCH_FIELD_REF, fields));
+
+    case 'e':
+      if (!parse_int (p, end, NPCH_FIELD_INT, fields)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_int (p, end, NPCH_FIELD_NAME, fields)
+	    || !parse_int (p, end, NPCH_FIELD_INT, fields))
+	  return false;
+      return true;
+
+    case '(':
+      if (!parse_int (p, end, NPCH_FIELD_INT, fields, &count)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields)
+	  || !parse_int (p, end, NPCH_FIELD_REF, fields))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_int (p, end, NPCH_FIELD_REF, fields))
+	  return false;
+      return parse_attributes (p, end, fields);
+
+    case '{':
+    case '|':
+      if (!parse_int (p, end, NPCH_FIELD_INT, fields)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_int (p, end, NPCH_FIELD_NAME, fields)
+	    || !parse_int (p, end, NPCH_FIELD_REF, fields)
+	    || !parse_int (p, end, NPCH_FIELD_INT, fields)
+	    || !parse_int (p, end, NPCH_FIELD_INT, fields)
+	    || !parse_int (p, end, NPCH_FIELD_INT, fields)
+	    || !parse_int (p, end, NPCH_FIELD_INT, fields))
+	  return false;
+      return true;
+
+    case 'S':
+      {
+	char what;
+	if (!parse_byte (p, end, fields, &what)
+	    || !parse_int (p, end, NPCH_FIELD_NAME, fields)
+	    || !parse_int (p, end, NPCH_FIELD_REF, fields)
+	    || !parse_int (p, end, NPCH_FIELD_NAME, fields)
+	    || !parse_int (p, end, NPCH_FIELD_INT, fields)
+	    || !parse_location (p, end, fields)
+	    || !parse_attributes (p, end, fields))
+	  return false;
+	// An inline function also refers to its body.
+	return what != 'i' || parse_int (p, end, NPCH_FIELD_REF, fields);
+      }
+
+    case 'B':
+      if (!parse_int (p, end, NPCH_FIELD_INT, fields)
+	  || !parse_item (p, end, fields, 0)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_item (p, end, fields, 0))
+	  return false;
+      return parse_item (p, end, fields, 0);
+
+    case 'M':
+      if (!parse_byte (p, end, fields)
+	  || !parse_location (p, end, fields)
+	  || !parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	if (!parse_int (p, end, NPCH_FIELD_NAME, fields))
+	  return false;
+      if (!parse_int (p, end, NPCH_FIELD_INT, fields, &count))
+	return false;
+      for (int64_t n = npch_unzigzag (count); n > 0; --n)
+	{
+	  char kind;
+	  if (!parse_byte (p, end, fields)
+	      || !parse_byte (p, end, fields, &kind)
+	      || !parse_int (p, end, NPCH_FIELD_INT, fields))
+	    return false;
+	  if (kind == 'n' || kind == 's')
+	    {
+	      if (!parse_int (p, end, NPCH_FIELD_NAME, fields))
+		return false;
+	    }
+	  else if (kind == 'a')
+	    {
+	      if (!parse_int (p, end, NPCH_FIELD_INT, fields))
+		return false;
+	    }
+	  else if (kind != '-')
+	    return false;
+	}
+      return true;
+    }
+
+  return false;
+}
+
+bool
+npch_check_record (const uint8_t *data, size_t length, size_t n_records,
+		   size_t strings_length, size_t n_bases,
+		   std::vector<npch_field> *fields)
+{
+  fields->clear ();
+  if (!npch_parse_record (&data, data + length, fields))
+    return false;
+  if ((*fields)[0].value == 'X' && (*fields)[1].value >= n_bases)
+    return false;
+  for (const npch_field &field : *fields)
+    if ((field.kind == NPCH_FIELD_REF
+	 && field.value >= NPCH_FIRST_RECORD + n_records)
+	|| (field.kind == NPCH_FIELD_NAME && field.value >= strings_length))
+      return false;
+  return true;
+}
+
+void
+npch_encode_record (const std::vector<npch_field> &fields, std::string *out)
+{
+  for (const npch_field &field : fields)
+    {
+      if (field.kind == NPCH_FIELD_BYTE)
+	out->push_back (char (field.value));
+      else
+	{
+	  uint8_t buf[NPCH_MAX_VARINT];
+	  size_t n = npch_encode_uint (buf, field.value);
+	  out->append (reinterpret_cast<const char *> (buf), n);
+	}
+    }
+}
@@ -0,0 +1,249 @@
+// Read the contents of a .npch file.  This does not depend on GCC,
+// so it is shared by the plugin and the tools.
+
+#ifndef NPCH_NPCHFILE_HH
+#define NPCH_NPCHFILE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "format.hh"
+
+// A file that a .npch file was built from; see format.hh.
+struct npch_dependency
+{
+  std::string path;
+  uint64_t size;
+  // The modification time, in nanoseconds.
+  uint64_t mtime;
+  // The npch_hash_bytes of the contents.
+  uint64_t hash;
+};
+
+// Fill in DEP for the file at PATH.  The contents are only hashed if
+// HASH is true.  Returns false and leaves errno set on failure.
+bool npch_stat_dependency (const char *path, npch_dependency *dep,
+			   bool hash);
+
+// A file that a .npch file is layered on; see format.hh.
+struct npch_base
+{
+  std::string path;
+  uint64_t checksum;
+};
+
+// How much an importer checks a file before reading records from it.
+enum npch_validation
+{
+  // Check each field as it is read.
+  NPCH_VALIDATE_NONE,
+  // Compare the checksum, and if it matches, trust the writer's own
+  // check of the records.
+  NPCH_VALIDATE_CHECKSUM,
+  // Check every record.
+  NPCH_VALIDATE_FULL
+};
+
+class npch_file
+{
+public:
+
+  // Read the file held in the LENGTH bytes at DATA, which must stay
+  // valid for the lifetime of this object.
+  npch_file (const uint8_t *data, size_t length);
+
+  npch_file (const npch_file &) = delete;
+  npch_file &operator= (const npch_file &) = delete;
+
+  // Check the header and the tables.  Returns false if the data is
+  // not a usable .npch file of this version.  Nothing else may be
+  // called unless this succeeds.
+  bool init ();
+
+  uint32_t flags () const
+  {
+    return m_flags;
+  }
+
+  // The checksum from the header.
+  uint64_t checksum () const
+  {
+    return npch_get_u64 (m_data + NPCH_CHECKSUM_OFFSET);
+  }
+
+  // The files this one is layered on.  Base I is the one that 'X'
+  // records with a base index of I refer to.
+  const std::vector<npch_base> &bases () const
+  {
+    return m_bases;
+  }
+
+  // Find the bytes of section WHICH, as an offset from the start of
+  // the file.
+  void get_section (int which, size_t *offset, size_t *length) const
+  {
+    *offset = m_sections[which].offset;
+    *length = m_sections[which].length;
+  }
+
+  // Look up LEN bytes of NAME, whose hash is HASH, in the directory
+  // WHICH.  On success, set *RECORD to the ID of the record it is
+  // bound to.
+  bool lookup (npch_directory which, uint32_t hash, const char *name,
+	       size_t len, uint64_t *record) const;
+
+  // Call FN with the hash, name, name length and record ID of each
+  // entry of the directory WHICH.
+  void for_each_entry (npch_directory which,
+		       const std::function<void (uint32_t, const char *,
+						 size_t, uint32_t)> &fn) const;
+
+  // Return the Bloom filter of the directory WHICH in *BITS and its
+  // size in *LOG2.
+  void get_filter (npch_directory which, const uint8_t **bits,
+		   uint32_t *log2) const
+  {
+    const directory &dir = m_directories[which];
+    *bits = dir.filter;
+    *log2 = dir.filter_log2;
+  }
+
+  // Find the string table entry REF.  Returns false if it is out of
+  // bounds.
+  bool get_string (uint64_t ref, const char **str, size_t *len,
+		   uint32_t *hash) const;
+
+  // Read the manifest into *CONFIG and *DEPS.  Returns false if it
+  // is malformed.
+  bool get_manifest (std::string *config,
+		     std::vector<npch_dependency> *deps) const;
+
+  // Check that the file was built with the configuration CONFIG, and
+  // that none of its dependencies has changed since.  If it is
+  // stale, return false and describe why in *REASON.
+  bool check_manifest (const std::string &config, std::string *reason) const;
+
+  // Check the file as MODE says.  If it is corrupt, return false and
+  // describe why in *REASON.  This may inflate the whole pool.
+  bool validate (npch_validation mode, std::string *reason);
+
+  // True if validate has shown that every record is well formed, so
+  // that records can be decoded without bounds checks.
+  bool trusted () const
+  {
+    return m_trusted;
+  }
+
+  // The number of records in the file.  Their IDs start at
+  // NPCH_FIRST_RECORD.
+  size_t num_records () const
+  {
+    return m_n_records;
+  }
+
+  // Find the record with the given ID.  On success, set *DATA to its
+  // first byte and *LENGTH to the number of bytes that may be read
+  // from there; the record ends somewhere within them.  This may
+  // inflate a block of a compressed pool, so it is not thread-safe.
+  bool get_record (uint64_t id, const uint8_t **data, size_t *length);
+
+private:
+
+  struct section
+  {
+    size_t offset;
+    size_t length;
+  };
+
+  // A name directory; see format.hh.
+  struct directory
+  {
+    const uint8_t *start;
+    uint32_t log2;
+
+    // The Bloom filter for the directory, with 2**FILTER_LOG2 bits.
+    const uint8_t *filter;
+    uint32_t filter_log2;
+  };
+
+  bool init_directory (int which, directory *result);
+  bool init_filter (const uint8_t **p, const uint8_t *end,
+		    directory *result);
+  bool init_blocks ();
+  bool init_bases ();
+  bool get_block (uint64_t offset, const uint8_t **data, size_t *length,
+		  uint64_t *start);
+
+  const uint8_t *m_data;
+  size_t m_length;
+  uint32_t m_flags;
+  bool m_trusted;
+  section m_sections[NPCH_NUM_SECTIONS];
+
+  directory m_directories[NPCH_NUM_DIRECTORIES];
+
+  std::vector<npch_base> m_bases;
+
+  // The string table.
+  const uint8_t *m_strings;
+  size_t m_strings_length;
+
+  // The pool offset of each record, each M_OFFSET_WIDTH bytes.
+  const uint8_t *m_record_offsets;
+  size_t m_offset_width;
+  size_t m_n_records;
+
+  // The constant pool, and its length once uncompressed.
+  const uint8_t *m_pool;
+  uint64_t m_pool_length;
+
+  // The block table of a compressed pool, and the inflated blocks
+  // that have been needed so far.  M_N_BLOCKS is zero if the pool is
+  // not compressed.
+  const uint8_t *m_blocks;
+  size_t m_n_blocks;
+  std::vector<std::unique_ptr<uint8_t[]>> m_block_cache;
+};
+
+// The kinds of field in a record.
+enum npch_field_kind
+{
+  // A single byte, such as the tag that starts every record.
+  NPCH_FIELD_BYTE,
+  // An integer.  VALUE holds it as encoded, so a signed integer is
+  // still zigzag encoded.
+  NPCH_FIELD_INT,
+  // The ID of another record.
+  NPCH_FIELD_REF,
+  // A string table reference.
+  NPCH_FIELD_NAME
+};
+
+struct npch_field
+{
+  npch_field_kind kind;
+  uint64_t value;
+};
+
+// Split the record starting at *P into its fields, appending them to
+// FIELDS.  On success, advance *P past the record.  Returns false if
+// the record is malformed or runs past END.
+bool npch_parse_record (const uint8_t **p, const uint8_t *end,
+			std::vector<npch_field> *fields);
+
+// Check that the record in the LENGTH bytes at DATA is well formed,
+// and that it only refers to the N_RECORDS records, the
+// STRINGS_LENGTH bytes of string table and the N_BASES bases of its
+// file.  FIELDS is scratch space.
+bool npch_check_record (const uint8_t *data, size_t length,
+			size_t n_records, size_t strings_length,
+			size_t n_bases, std::vector<npch_field> *fields);
+
+// Encode FIELDS as a record, appending it to OUT.
+void npch_encode_record (const std::vector<npch_field> &fields,
+			 std::string *out);
+
+#endif // NPCH_NPCHFILE_HH
@@ -1,10 +1,19 @@
 #include "pch_plugin.hh"
 #include "readhash.hh"
 #include "writer.hh"
+#include "util.hh"
 #include "c-family/c-pragma.h"
 #include "toplev.h"
+#include "diagnostic-core.h"
+#include "timevar.h"
+#include "incpath.h"
+#include "opts.h"
+#include "version.hh"
+#include "format.hh"
+#include "stringpool.h"
+#include "function.h"
+#include "cgraph.h"
 #include "plugin-version.h"
-#include "fclose_deleter.hh"
 
 #ifdef __GNUC__
 #pragma GCC visibility push(default)
@@ -16,7 +25,19 @@ int plugin_is_GPL_compatible;
 
 pch_plugin *pch_plugin::singleton;
 
-pch_plugin::pch_plugin(const char *plugin_name)
+pch_plugin::pch_plugin(const char *plugin_name, const char *plugin_path)
+  : all_loaded (true),
+    duplicates (DUPLICATES_FIRST),
+    stale (STALE_WARN),
+    show_stats (false),
+    oracle_queries (0),
+    oracle_misses (0),
+    plugin_name (plugin_name),
+    plugin_path (plugin_path),
+    pool_policy (mapped_file::ACCESS_RANDOM),
+    validation (NPCH_VALIDATE_NONE),
+    next_builtin_macro (nullptr),
+    next_undef (nullptr)
 {
   assert (singleton == nullptr);
   singleton = this;
@@ -24,33 +45,292 @@ pch_plugin::pch_plugin(const char *plugin_name)
 
   register_callback (plugin_name, PLUGIN_PRAGMAS, init_pragmas, nullptr);
   register_callback (plugin_name, PLUGIN_GGC_MARKING, exported_mark, NULL);
+  register_callback (plugin_name, PLUGIN_FINISH, exported_finish, NULL);
 }
 
-void
-pch_plugin::binding_oracle (c_oracle_request kind, tree identifier)
+// True if every base of NPCH still has the checksum NPCH recorded
+// for it.  If not, describe which changed in *REASON.  A base that
+// cannot be read is left for the main thread to report when it
+// imports it.
+
+static bool
+bases_unchanged_p (const npch_file &npch, std::string *reason)
 {
-  const char *name = IDENTIFIER_POINTER (identifier);
+  for (const npch_base &base : npch.bases ())
+    {
+      mapped_file file;
+      if (!file.open (base.path.c_str ()))
+	continue;
+      npch_file current (file.data (), file.size ());
+      if (current.init () && current.checksum () != base.checksum)
+	{
+	  *reason = "'" + base.path + "' has changed";
+	  return false;
+	}
+    }
+  return true;
+}
 
-  for (auto &iter : maps)
+/* static */ pch_plugin::import_result
+pch_plugin::load (std::string filename, std::unique_ptr<mapped_file> file,
+		  mapped_file::access_policy pool_policy,
+		  npch_validation validation, stale_policy stale,
+		  const std::string *config,
+		  const npch_cache_request *request,
+		  merged_index *index, unsigned ordinal)
+{
+  // This runs on a worker thread, so it must not touch any GCC
+  // state.
+  import_result result;
+  result.errnum = 0;
+  result.setup_time = std::chrono::nanoseconds::zero ();
+
+  // A cached file has already been checked, or freshly made.
+  if (request != nullptr)
     {
-      tree result = iter->find (kind, name);
-      if (result != NULL_TREE)
+      if (!npch_cache_ensure (*request, *config, &result.cache_error))
+	return result;
+      stale = STALE_IGNORE;
+    }
+
+  auto start = std::chrono::steady_clock::now ();
+  if (!file)
+    {
+      file.reset (new mapped_file ());
+      if (!file->open (filename.c_str ()))
 	{
-	  if (kind == C_ORACLE_SYMBOL)
-	    {
-	      c_bind (BUILTINS_LOCATION /* FIXME */, result, 1);
-	      rest_of_decl_compilation (result, 1, 0);
-	    }
+	  result.errnum = errno;
+	  return result;
+	}
+    }
+
+  std::unique_ptr<mapped_hash> map (new mapped_hash (std::move (file)));
+  if (!map->init (pool_policy))
+    {
+      result.invalid = "not a valid .npch file";
+      return result;
+    }
+
+  // Checking the records once here means they can be decoded
+  // without bounds checks later, when it matters more.
+  if (!map->validate (validation, &result.invalid))
+    return result;
+
+  // A stale file must be rejected before it is merged into the
+  // index, so this check cannot wait for the main thread.
+  if (stale != STALE_IGNORE
+      && !map->check_manifest (*config, &result.stale)
+      && stale != STALE_WARN)
+    return result;
+
+  // So must a file layered on a base that has changed since, as its
+  // 'X' records may now name other records.
+  if (stale != STALE_IGNORE && result.stale.empty ()
+      && !bases_unchanged_p (map->npch (), &result.stale)
+      && stale != STALE_WARN)
+    return result;
+
+  index->add (map.get (), ordinal);
+  result.map = std::move (map);
+  result.setup_time = std::chrono::steady_clock::now () - start;
+  return result;
+}
+
+mapped_hash *
+pch_plugin::wait (import &imp)
+{
+  if (imp.loading.valid ())
+    {
+      import_result result = imp.loading.get ();
+      imp.map = std::move (result.map);
+      imp.setup_time = result.setup_time;
+      if (!result.cache_error.empty ())
+	imp.failure = "failed, could not be generated";
+      else if (!result.invalid.empty ())
+	imp.failure = "failed, corrupt";
+      else if (result.errnum != 0)
+	imp.failure = "failed, could not be mapped";
+      else if (!result.stale.empty ())
+	imp.failure = (stale == STALE_SKIP ? "skipped, out of date"
+		       : "failed, out of date");
+
+      if (!result.cache_error.empty ())
+	error ("npch: could not generate %qs for %qs: %s",
+	       imp.filename.c_str (), imp.request->header.c_str (),
+	       result.cache_error.c_str ());
+      else if (!result.invalid.empty ())
+	error ("npch: %qs is corrupt: %s", imp.filename.c_str (),
+	       result.invalid.c_str ());
+      else if (result.errnum != 0)
+	{
+	  errno = result.errnum;
+	  error ("npch: could not map %qs: %m", imp.filename.c_str ());
+	}
+      else if (!result.stale.empty ())
+	{
+	  if (stale == STALE_ERROR)
+	    error ("npch: %qs is out of date: %s", imp.filename.c_str (),
+		   result.stale.c_str ());
+	  else if (stale == STALE_SKIP)
+	    warning (0, "npch: %qs is out of date, not using it: %s",
+		     imp.filename.c_str (), result.stale.c_str ());
 	  else
-	    {
-	      assert (kind == C_ORACLE_TAG);
-	      c_pushtag (BUILTINS_LOCATION /* FIXME */, identifier, result);
-	    }
-	  // Perhaps instead we should search for and reject
-	  // duplicates here.
-	  break;
+	    warning (0, "npch: %qs is out of date: %s",
+		     imp.filename.c_str (), result.stale.c_str ());
 	}
+
+      if (imp.map)
+	link_bases (imp.map.get ());
+      else
+	forget_macros (&imp);
     }
+  return imp.map.get ();
+}
+
+void
+pch_plugin::wait_all ()
+{
+  if (all_loaded)
+    return;
+  for (auto &imp : imports)
+    wait (imp);
+  all_loaded = true;
+}
+
+// Build the declaration of the constant NAME of ENUMTYPE, or return
+// NULL_TREE if it has no such constant.
+
+static tree
+make_enumerator (tree enumtype, tree name)
+{
+  for (tree iter = TYPE_VALUES (enumtype); iter; iter = TREE_CHAIN (iter))
+    if (TREE_PURPOSE (iter) == name)
+      {
+	tree decl = build_decl (BUILTINS_LOCATION /* FIXME */, CONST_DECL,
+				name, enumtype);
+	DECL_INITIAL (decl) = TREE_VALUE (iter);
+	return decl;
+      }
+  return NULL_TREE;
+}
+
+// True if IMP may bind a name with hash HASH, as a tag if TAGS.  An
+// import whose filter could not be read may bind anything.
+
+/* static */ bool
+pch_plugin::may_bind (const import &imp, bool tags, uint32_t hash)
+{
+  const std::vector<uint8_t> &filter = imp.filters[tags ? 1 : 0];
+  return (filter.empty ()
+	  || npch_filter_test (filter.data (),
+			       imp.filter_log2[tags ? 1 : 0], hash));
+}
+
+void
+pch_plugin::binding_oracle (c_oracle_request kind, tree identifier)
+{
+  if (kind != C_ORACLE_SYMBOL && kind != C_ORACLE_TAG)
+    return;
+  // The front end only asks once per name, but it does not know
+  // about bindings made by resolve_global.
+  if (kind == C_ORACLE_SYMBOL && resolved_identifiers.count (identifier))
+    return;
+
+  auto_client_timevar tv ("npch oracle");
+  ++oracle_queries;
+
+  // A miss can only be trusted once every import that may bind the
+  // name has been merged into the index.  The others can keep
+  // loading; their filters say they do not have it.
+  bool tags = kind == C_ORACLE_TAG;
+  uint32_t hash = IDENTIFIER_HASH_VALUE (identifier);
+  if (!all_loaded)
+    for (auto &imp : imports)
+      if (imp.loading.valid () && may_bind (imp, tags, hash))
+	wait (imp);
+
+  merged_index::entry entry;
+  if (!index.find (tags, hash, IDENTIFIER_POINTER (identifier),
+		   IDENTIFIER_LENGTH (identifier), &entry))
+    {
+      ++oracle_misses;
+      return;
+    }
+  ++entry.map->stats ().hits;
+
+  if (entry.duplicated && duplicates == DUPLICATES_WARN)
+    warning (0, "npch: %qE is defined by more than one import", identifier);
+  else if (entry.duplicated && duplicates == DUPLICATES_ERROR)
+    {
+      error ("npch: %qE is defined by more than one import", identifier);
+      return;
+    }
+
+  tree result = entry.map->find_type (entry.record);
+  if (result == error_mark_node)
+    return;
+
+  if (kind == C_ORACLE_SYMBOL && TREE_CODE (result) == ENUMERAL_TYPE)
+    {
+      // IDENTIFIER is one of the constants of the enum.  Only it is
+      // bound, so that the others are still looked up lazily, and
+      // can be shadowed like any other imported name.
+      tree decl = make_enumerator (result, identifier);
+      if (decl != NULL_TREE)
+	c_bind (BUILTINS_LOCATION /* FIXME */, decl, 1);
+    }
+  else if (kind == C_ORACLE_SYMBOL)
+    {
+      c_bind (DECL_SOURCE_LOCATION (result), result, 1);
+      if (entry.map->has_body (result))
+	define_inline (entry.map, result);
+      else
+	rest_of_decl_compilation (result, 1, 0);
+    }
+  else
+    c_pushtag (BUILTINS_LOCATION /* FIXME */, identifier, result);
+}
+
+// Find the file-scope declaration of IDENTIFIER, which an inline
+// function body refers to, binding it from the imports if need be.
+// The front end turns off the oracle while calling it, so
+// lookup_name would not do this.
+
+tree
+pch_plugin::resolve_global (tree identifier)
+{
+  tree decl = identifier_global_value (identifier);
+  if (decl == NULL_TREE && resolved_identifiers.count (identifier) == 0)
+    {
+      binding_oracle (C_ORACLE_SYMBOL, identifier);
+      resolved_identifiers.insert (identifier);
+      decl = identifier_global_value (identifier);
+    }
+  return decl;
+}
+
+// Read the body of the inline function FNDECL from MAP and hand it to
+// the middle end, the same way finish_function does once the front
+// end has parsed a definition.
+
+void
+pch_plugin::define_inline (mapped_hash *map, tree fndecl)
+{
+  if (!map->read_body (fndecl, [this] (tree identifier)
+		       {
+			 return resolve_global (identifier);
+		       }))
+    {
+      error ("npch: could not read the body of %qD", fndecl);
+      rest_of_decl_compilation (fndecl, 1, 0);
+      return;
+    }
+
+  // This may well happen in the middle of another function, so keep
+  // cfun as it is, and do not collect garbage.
+  push_struct_function (fndecl);
+  pop_cfun ();
+  cgraph_node::finalize_function (fndecl, true);
 }
 
 /* static */ void
@@ -60,23 +340,71 @@ pch_plugin::exported_binding_oracle (c_oracle_request kind, tree identifier)
   singleton->binding_oracle (kind, identifier);
 }
 
-size_t
-pch_plugin::read_file (const char *filename, char **data)
+bool
+pch_plugin::handle_argument (const char *key, const char *value)
 {
-  struct stat sbuf;
-  std::unique_ptr<FILE, fclose_deleter> f (fopen (filename, "r"));
-  if (!f)
-    return 0;
-  if (fstat (fileno (f.get ()), &sbuf) < 0)
-    return 0;
-  *data = new char[sbuf.st_size];
-  if (fread (*data, 1, sbuf.st_size, f.get ()) != sbuf.st_size)
+  if (strcmp (key, "madvise") == 0)
+    {
+      if (value == nullptr
+	  || !mapped_file::parse_policy (value, &pool_policy))
+	error ("npch: unknown madvise policy %qs", value ? value : "");
+      return true;
+    }
+  else if (strcmp (key, "duplicates") == 0)
+    {
+      if (value != nullptr && strcmp (value, "first") == 0)
+	duplicates = DUPLICATES_FIRST;
+      else if (value != nullptr && strcmp (value, "warn") == 0)
+	duplicates = DUPLICATES_WARN;
+      else if (value != nullptr && strcmp (value, "error") == 0)
+	duplicates = DUPLICATES_ERROR;
+      else
+	error ("npch: unknown duplicates policy %qs", value ? value : "");
+      return true;
+    }
+  else if (strcmp (key, "cache") == 0)
+    {
+      if (value == nullptr || value[0] == '\0')
+	error ("npch: the cache argument needs a directory");
+      else
+	cache_dir = value;
+      return true;
+    }
+  else if (strcmp (key, "stale") == 0)
     {
-      delete[] *data;
-      return 0;
+      if (value != nullptr && strcmp (value, "ignore") == 0)
+	stale = STALE_IGNORE;
+      else if (value != nullptr && strcmp (value, "warn") == 0)
+	stale = STALE_WARN;
+      else if (value != nullptr && strcmp (value, "skip") == 0)
+	stale = STALE_SKIP;
+      else if (value != nullptr && strcmp (value, "error") == 0)
+	stale = STALE_ERROR;
+      else
+	error ("npch: unknown stale policy %qs", value ? value : "");
+      return true;
+    }
+  else if (strcmp (key, "validate") == 0)
+    {
+      if (value != nullptr && strcmp (value, "none") == 0)
+	validation = NPCH_VALIDATE_NONE;
+      else if (value != nullptr && strcmp (value, "checksum") == 0)
+	validation = NPCH_VALIDATE_CHECKSUM;
+      else if (value != nullptr && strcmp (value, "full") == 0)
+	validation = NPCH_VALIDATE_FULL;
+      else
+	error ("npch: unknown validate policy %qs", value ? value : "");
+      return true;
+    }
+  else if (strcmp (key, "stats") == 0)
+    {
+      if (value != nullptr)
+	error ("npch: the stats argument takes no value");
+      show_stats = true;
+      return true;
     }
 
-  return sbuf.st_size;
+  return false;
 }
 
 void
@@ -87,27 +415,365 @@ pch_plugin::pragma_import_pch ()
 
   if (type == CPP_STRING)
     {
-      // If we wanted to be tricky we could read the file in a
-      // separate thread.  This would require just a tiny bit of
-      // locking to present a consistent view to the C parser.
-      char *data;
-      size_t len = read_file (TREE_STRING_POINTER (value), &data);
-      if (!len)
+      auto_client_timevar tv ("npch import");
+      const char *filename = TREE_STRING_POINTER (value);
+
+      // The type nodes only exist once the front end is running.
+      if (config.empty ())
+	config = npch_config ();
+
+      // With a cache, anything that is not a .npch file names a
+      // header, whose .npch file is found or made in the cache.
+      std::unique_ptr<npch_cache_request> request;
+      size_t len = strlen (filename);
+      if (!cache_dir.empty ()
+	  && (len < 5 || strcmp (filename + len - 5, ".npch") != 0))
 	{
-	  // FIXME error.
+	  request.reset (new npch_cache_request ());
+	  if (!make_cache_request (filename, request.get ()))
+	    {
+	      error ("npch: %qs not found in the include path", filename);
+	      return;
+	    }
 	}
-      else
+
+      import_file (filename, std::move (request));
+    }
+  else
+    {
+      // FIXME error
+    }
+}
+
+// Import FILENAME, or the header REQUEST names if it is not null,
+// unless that file has been imported already, and return the import.
+// Only the names of the file's macros are read here, since they must
+// be known before the lexer reads past the pragma; the rest is left
+// to a worker thread, which is only waited for when a name is first
+// looked up.
+
+pch_plugin::import *
+pch_plugin::import_file (const char *filename,
+			 std::unique_ptr<npch_cache_request> request)
+{
+  struct stat sbuf;
+  const char *key = request ? request->header.c_str () : filename;
+  bool identified = stat (key, &sbuf) == 0;
+  std::pair<dev_t, ino_t> id;
+  if (identified)
+    {
+      id = std::make_pair (sbuf.st_dev, sbuf.st_ino);
+      auto found = imported_files.find (id);
+      if (found != imported_files.end ())
+	return (*found).second;
+    }
+
+  imports.emplace_back ();
+  import &imp = imports.back ();
+  // Bases are imported before the worker is started, but after this.
+  unsigned ordinal = imports.size () - 1;
+  if (identified)
+    imported_files[id] = &imp;
+  imp.filename = request ? request->npch : std::string (filename);
+  imp.request = std::move (request);
+
+  // Mapping the file and walking its macro directory is cheap.  A
+  // cached file may not have been generated yet, though, so that
+  // waits for the worker below.
+  std::unique_ptr<mapped_file> file;
+  if (!imp.request)
+    {
+      file.reset (new mapped_file ());
+      if (!file->open (imp.filename.c_str ()))
+	{
+	  error ("npch: could not map %qs: %m", imp.filename.c_str ());
+	  imp.failure = "failed, could not be mapped";
+	  return &imp;
+	}
+      // If this fails, the worker says why.
+      npch_file npch (file->data (), file->size ());
+      if (npch.init ())
 	{
-	  std::unique_ptr<mapped_hash> hash
-	    (new mapped_hash ((const uint8_t *) data, len));
-	  if (hash->init ())
-	    maps.push_back (std::move(hash));
+	  // The filters are copied, since the worker owns the mapping.
+	  for (int which = 0; which < 2; ++which)
+	    {
+	      const uint8_t *bits;
+	      uint32_t log2;
+	      npch.get_filter (npch_directory (which), &bits, &log2);
+	      size_t size = (size_t (1) << log2) / 8;
+	      imp.filters[which].assign (bits, bits + size);
+	      imp.filter_log2[which] = log2;
+	    }
+	  enter_names (&imp, npch);
 	}
     }
+
+  // Check the file on a worker thread, which also merges its names
+  // into the index.
+  imp.loading = std::async (std::launch::async, load, imp.filename,
+			    std::move (file), pool_policy, validation,
+			    stale, &config, imp.request.get (), &index,
+			    ordinal);
+  all_loaded = false;
+
+  if (imp.request)
+    {
+      mapped_hash *map = wait (imp);
+      if (map != nullptr)
+	enter_names (&imp, map->npch ());
+    }
+  return &imp;
+}
+
+// Enter the macros of NPCH, the file of IMP, and import the files it
+// is layered on, so that their macros are known too.  Their other
+// names are visible as if they had been imported directly, much as a
+// header's own includes are.
+
+void
+pch_plugin::enter_names (import *imp, const npch_file &npch)
+{
+  define_macros (imp, npch);
+  for (const npch_base &base : npch.bases ())
+    import_file (base.path.c_str (), nullptr);
+}
+
+// Link MAP to the files it is layered on, so that its 'X' records
+// can be resolved.  The worker has already applied the stale policy
+// to a base that changed; see load.  Unless that policy let it
+// through, a base found changed here is not linked, since its record
+// IDs may mean something else now, and the records that refer to it
+// fail to read.
+
+void
+pch_plugin::link_bases (mapped_hash *map)
+{
+  const std::vector<npch_base> &bases = map->bases ();
+  for (size_t i = 0; i < bases.size (); ++i)
+    {
+      mapped_hash *base = wait (*import_file (bases[i].path.c_str (),
+					      nullptr));
+      if (base != nullptr
+	  && (base->checksum () == bases[i].checksum
+	      || stale == STALE_WARN || stale == STALE_IGNORE))
+	map->set_base (i, base);
+    }
+}
+
+bool
+pch_plugin::find_origin (tree t, npch_origin *origin)
+{
+  uint64_t record;
+  for (const import &imp : imports)
+    if (imp.map && imp.map->origin (t, &record))
+      {
+	origin->file = absolute_path (imp.filename.c_str ());
+	origin->checksum = imp.map->checksum ();
+	origin->record = record;
+	return true;
+      }
+  return false;
+}
+
+// Find HEADER the way #include "HEADER" would, and fill in REQUEST
+// to find or make its .npch file in the cache.  The cache key covers
+// everything that could change the result: the plugin version, the
+// compiler configuration, the header and its contents, and the
+// options that affect parsing.  Headers it includes are covered by
+// the manifest of the cached file instead.  Returns false if HEADER
+// cannot be found.
+
+bool
+pch_plugin::make_cache_request (const char *header,
+				npch_cache_request *request)
+{
+  std::vector<std::string> dirs;
+  if (!IS_ABSOLUTE_PATH (header))
+    {
+      std::string current = LOCATION_FILE (input_location);
+      size_t slash = current.rfind ('/');
+      dirs.push_back (slash == std::string::npos ? std::string (".")
+		      : current.substr (0, slash));
+      // The quote chain continues into the bracket chain.
+      for (cpp_dir *dir = get_added_cpp_dirs (INC_QUOTE); dir;
+	   dir = dir->next)
+	dirs.push_back (dir->name);
+    }
   else
+    dirs.push_back (std::string ());
+
+  mapped_file contents;
+  for (const std::string &dir : dirs)
     {
-      // FIXME error
+      std::string path = dir.empty () ? header : dir + "/" + header;
+      if (contents.open (path.c_str ()))
+	{
+	  request->header = path;
+	  break;
+	}
+    }
+  if (request->header.empty ())
+    return false;
+
+  std::vector<std::string> options = parse_options (true);
+
+  uint64_t hash = NPCH_HASH_BYTES_INIT;
+  std::string key = std::to_string (PCH_PLUGIN_VERSION);
+  key += '\0';
+  key += config;
+  key += '\0';
+  key += request->header;
+  key += '\0';
+  for (const std::string &option : options)
+    {
+      key += option;
+      key += '\0';
+    }
+  hash = npch_hash_bytes (reinterpret_cast<const uint8_t *> (key.data ()),
+			  key.size (), hash);
+  hash = npch_hash_bytes (contents.data (), contents.size (), hash);
+
+  const char *base = lbasename (request->header.c_str ());
+  char hex[17];
+  snprintf (hex, sizeof (hex), "%016llx", (unsigned long long) hash);
+  request->npch = cache_dir + "/" + base + "-" + hex + ".npch";
+  request->lock = request->npch + ".lock";
+
+  const char *driver = getenv ("COLLECT_GCC");
+  request->argv.push_back (driver ? driver : "gcc");
+  request->argv.push_back ("-x");
+  request->argv.push_back ("c");
+  request->argv.push_back ("--syntax-only");
+  request->argv.insert (request->argv.end (), options.begin (),
+			options.end ());
+  request->argv.push_back ("-fplugin=" + plugin_path);
+  request->argv.push_back ("-fplugin-arg-" + plugin_name + "-output="
+			   + request->npch);
+  request->argv.push_back (request->header);
+  return true;
+}
+
+// Make every macro of NPCH, the file of IMP, known to the
+// preprocessor, without reading any of them.  Each becomes a user
+// builtin macro, which libcpp hands to builtin_macro the first time
+// it is expanded or tested.  A name that is already a macro keeps
+// its definition, so the first import to define a macro wins, as for
+// declarations.
+
+void
+pch_plugin::define_macros (import *imp, const npch_file &npch)
+{
+  cpp_callbacks *cb = cpp_get_callbacks (parse_in);
+  if (cb->user_builtin_macro != exported_builtin_macro)
+    {
+      // The front end installs its own hook while predefining
+      // macros, which is over by the time a pragma is seen.
+      next_builtin_macro = cb->user_builtin_macro;
+      cb->user_builtin_macro = exported_builtin_macro;
+      next_undef = cb->undef;
+      cb->undef = exported_undef;
+    }
+
+  npch.for_each_entry (NPCH_DIRECTORY_MACROS,
+		       [&] (uint32_t hash, const char *name, size_t len,
+			    uint32_t record)
+		       {
+			 cpp_hashnode *node
+			   = CPP_HASHNODE (ht_lookup_with_hash
+					   (ident_hash,
+					    (const unsigned char *) name,
+					    len, hash, HT_ALLOC));
+			 if (node->type != NT_VOID
+			     || (node->flags & NODE_POISONED) != 0)
+			   return;
+			 node->type = NT_MACRO;
+			 node->flags |= NODE_BUILTIN;
+			 // libcpp only calls the hook for a node that
+			 // has not been used.
+			 node->flags &= ~NODE_USED;
+			 node->value.builtin = BT_LAST_USER;
+			 lazy_macros[node] = std::make_pair (imp, record);
+		       });
+}
+
+bool
+pch_plugin::builtin_macro (cpp_reader *reader, cpp_hashnode *node)
+{
+  auto iter = lazy_macros.find (node);
+  if (iter == lazy_macros.end ())
+    return (next_builtin_macro != nullptr
+	    && next_builtin_macro (reader, node));
+
+  auto_client_timevar tv ("npch macros");
+  import *imp = (*iter).second.first;
+  uint32_t record = (*iter).second.second;
+  lazy_macros.erase (iter);
+  mapped_hash *map = wait (*imp);
+  cpp_macro *macro = map ? map->read_macro (record) : nullptr;
+  if (macro == nullptr)
+    {
+      // libcpp expects a macro now, so an empty one will have to do.
+      // If the import failed, that has been reported already.
+      if (map != nullptr)
+	error ("npch: could not read the definition of macro %qs",
+	       (const char *) NODE_NAME (node));
+      macro = ggc_cleared_alloc<cpp_macro> ();
+      macro->line = BUILTINS_LOCATION;
+    }
+
+  node->flags &= ~(NODE_BUILTIN | NODE_USED);
+  node->value.macro = macro;
+  return true;
+}
+
+/* static */ bool
+pch_plugin::exported_builtin_macro (cpp_reader *reader, cpp_hashnode *node)
+{
+  assert (singleton != nullptr);
+  return singleton->builtin_macro (reader, node);
+}
+
+// Undefine the macros of IMP that have not been read, since IMP
+// could not be used after all.  One that was already tested by #ifdef
+// stays defined, as an empty macro.
+
+void
+pch_plugin::forget_macros (import *imp)
+{
+  for (auto iter = lazy_macros.begin (); iter != lazy_macros.end (); )
+    if ((*iter).second.first == imp)
+      {
+	(*iter).first->type = NT_VOID;
+	(*iter).first->flags &= ~NODE_BUILTIN;
+	iter = lazy_macros.erase (iter);
+      }
+    else
+      ++iter;
+}
+
+// An imported macro that is #undef'd before it is used need never be
+// read.  Dropping it here also keeps libcpp from warning about
+// undefining a builtin.
+
+void
+pch_plugin::undef (cpp_reader *reader, source_location loc,
+		   cpp_hashnode *node)
+{
+  if (lazy_macros.erase (node) != 0)
+    {
+      node->type = NT_VOID;
+      node->flags &= ~NODE_BUILTIN;
     }
+  if (next_undef != nullptr)
+    next_undef (reader, loc, node);
+}
+
+/* static */ void
+pch_plugin::exported_undef (cpp_reader *reader, source_location loc,
+			    cpp_hashnode *node)
+{
+  assert (singleton != nullptr);
+  singleton->undef (reader, loc, node);
 }
 
 /* static */ void
@@ -126,8 +792,14 @@ pch_plugin::init_pragmas (void *, void *)
 void
 pch_plugin::mark ()
 {
-  for (auto &iter : maps)
-    iter->mark ();
+  // Shows up among the client items in -ftime-report.
+  auto_client_timevar tv ("npch GC marking");
+
+  // An import that is still loading has not instantiated anything
+  // yet, so there is no need to wait for it here.
+  for (auto &imp : imports)
+    if (imp.map)
+      imp.map->mark ();
 }
 
 /* static */ void
@@ -137,6 +809,77 @@ pch_plugin::exported_mark (void *, void *)
   singleton->mark ();
 }
 
+void
+pch_plugin::finish ()
+{
+  // Collect any import that was never needed, so that its errors are
+  // still reported and no worker is left running.
+  wait_all ();
+  if (show_stats)
+    report_stats ();
+}
+
+// Name a record by its tag byte TAG, for report_stats.
+
+static const char *
+record_kind (int tag)
+{
+  switch (tag)
+    {
+    case 'i': return "integer";
+    case 'f': return "real";
+    case 'p': return "pointer";
+    case 'q': return "qualified";
+    case '[': return "array";
+    case 'v': return "vector";
+    case 'c': return "complex";
+    case 'e': return "enum";
+    case '(': return "function";
+    case '{': return "struct";
+    case '|': return "union";
+    case 'S': return "symbol";
+    case 'M': return "macro";
+    case 'B': return "body";
+    case 'X': return "external";
+    default: return "other";
+    }
+}
+
+// Describe what each import cost, on stderr like -ftime-report.
+
+void
+pch_plugin::report_stats ()
+{
+  fprintf (stderr, "npch: %zu oracle queries, %zu not found\n",
+	   oracle_queries, oracle_misses);
+  for (const import &imp : imports)
+    {
+      const char *name = imp.filename.c_str ();
+      if (!imp.map)
+	{
+	  fprintf (stderr, "npch: %s: %s\n", name, imp.failure.c_str ());
+	  continue;
+	}
+
+      mapped_hash::statistics &stats = imp.map->stats ();
+      fprintf (stderr, "npch: %s: %zu bytes mapped, set up in %.3f ms, "
+	       "%zu oracle hits, records read in %.3f ms\n", name,
+	       imp.map->mapped_size (), imp.setup_time.count () / 1e6,
+	       stats.hits, stats.read_ns / 1e6);
+      for (int tag = 0; tag < 256; ++tag)
+	if (stats.records[tag] != 0)
+	  fprintf (stderr, "npch: %s:   %zu %s records\n", name,
+		   stats.records[tag], record_kind (tag));
+    }
+}
+
+/* static */ void
+pch_plugin::exported_finish (void *, void *)
+{
+  assert (singleton != nullptr);
+  singleton->finish ();
+}
+
 #ifdef __GNUC__
 #pragma GCC visibility push(default)
 #endif
@@ -148,17 +891,50 @@ plugin_init (struct plugin_name_args *plugin_info,
   if (!plugin_default_version_check (version, &gcc_version))
     return 1;
 
+  // Called for side effects.  So awful.
+  pch_plugin *plugin = new pch_plugin(plugin_info->base_name,
+				      plugin_info->full_name);
+
+  const char *output = nullptr;
+  int compression = -1;
+  std::vector<std::string> exports;
   for (int i = 0; i < plugin_info->argc; ++i)
     {
-      if (strcmp (plugin_info->argv[i].key, "output") == 0)
+      const char *key = plugin_info->argv[i].key;
+      const char *value = plugin_info->argv[i].value;
+
+      if (strcmp (key, "output") == 0)
 	{
-	  new hash_writer (plugin_info->base_name, plugin_info->argv[i].value);
-	  break;
+	  if (output == nullptr)
+	    output = value;
 	}
+      else if (strcmp (key, "compress") == 0)
+	{
+	  // A bare "compress" means level 6, zlib's default.
+	  if (value == nullptr)
+	    compression = 6;
+	  else if (value[0] >= '0' && value[0] <= '9' && value[1] == '\0')
+	    compression = value[0] - '0';
+	  else
+	    warning (0, "npch: invalid compression level %qs", value);
+	}
+      else if (strcmp (key, "export") == 0)
+	{
+	  if (value == nullptr || value[0] == '\0')
+	    warning (0, "npch: the export argument needs a pattern");
+	  else
+	    exports.push_back (value);
+	}
+      else if (!plugin->handle_argument (key, value))
+	warning (0, "npch: unrecognized plugin argument %qs", key);
     }
 
-  // Called for side effects.  So awful.
-  new pch_plugin(plugin_info->base_name);
+  if (output != nullptr)
+    new hash_writer (plugin_info->base_name, output, compression, exports,
+		     [plugin] (tree t, npch_origin *origin)
+		     {
+		       return plugin->find_origin (t, origin);
+		     });
 
   return 0;
 }
@@ -11,38 +11,195 @@
 #include <assert.h>
 #include <list>
 #include <memory>
+#include <string>
+#include <future>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <chrono>
+#include <vector>
+#include "mapfile.hh"
+#include "merged.hh"
+#include "cache.hh"
 
 class cpp_reader;
 class mapped_hash;
+class npch_file;
+struct npch_origin;
 
 class pch_plugin
 {
 public:
 
-  pch_plugin (const char *plugin_name);
+  // PLUGIN_NAME and PLUGIN_PATH are the name and the file name of
+  // the plugin, used to generate cached imports.
+  pch_plugin (const char *plugin_name, const char *plugin_path);
 
   ~pch_plugin ()
   {
   }
 
+  // Handle the plugin argument KEY=VALUE.  Returns false if KEY is
+  // not recognized.
+  bool handle_argument (const char *key, const char *value);
+
+  // If T was read from an import, set *ORIGIN to where, and return
+  // true.
+  bool find_origin (tree t, npch_origin *origin);
+
 private:
 
-  size_t read_file (const char *filename, char **data);
+  // The outcome of loading an import on a worker thread.
+  struct import_result
+  {
+    // The map, or null on failure.
+    std::unique_ptr<mapped_hash> map;
+    // On failure, the errno value from mapping the file, or 0 if the
+    // file is not a usable .npch file.
+    int errnum;
+    // If the file is stale, why.
+    std::string stale;
+    // If the file is corrupt, why.
+    std::string invalid;
+    // If a cached file could not be generated, why.
+    std::string cache_error;
+    // How long mapping the file and setting up its index took.
+    std::chrono::nanoseconds setup_time;
+  };
+
+  // An imported file.  It is loaded in the background, and LOADING
+  // stays valid until the main thread has collected the result.
+  struct import
+  {
+    std::string filename;
+    // For a header imported through the cache, how to find or make
+    // its .npch file.
+    std::unique_ptr<npch_cache_request> request;
+    std::future<import_result> loading;
+    std::unique_ptr<mapped_hash> map;
+    std::chrono::nanoseconds setup_time;
+    // If MAP is null, why the file is not used, for report_stats.
+    std::string failure;
+    // Copies of the Bloom filters of the symbol and tag directories,
+    // so that the oracle only waits for imports that may bind a
+    // name.  Empty if the file could not be read up front.
+    std::vector<uint8_t> filters[2];
+    uint32_t filter_log2[2];
+  };
+
+  // What to do when a name that is bound is defined by more than one
+  // import.  In every case the earliest import wins.
+  enum duplicate_policy
+  {
+    DUPLICATES_FIRST,
+    DUPLICATES_WARN,
+    DUPLICATES_ERROR
+  };
+
+  // What to do with an import whose headers have changed since it
+  // was written, or that was built with another configuration.
+  enum stale_policy
+  {
+    // Do not check.
+    STALE_IGNORE,
+    // Warn, but use the import anyway.
+    STALE_WARN,
+    // Warn and do not use the import.
+    STALE_SKIP,
+    STALE_ERROR
+  };
+
+  static import_result load (std::string filename,
+			     std::unique_ptr<mapped_file> file,
+			     mapped_file::access_policy pool_policy,
+			     npch_validation validation,
+			     stale_policy stale, const std::string *config,
+			     const npch_cache_request *request,
+			     merged_index *index, unsigned ordinal);
+  bool make_cache_request (const char *header, npch_cache_request *request);
+  mapped_hash *wait (import &imp);
+  void wait_all ();
+  static bool may_bind (const import &imp, bool tags, uint32_t hash);
 
   void binding_oracle (c_oracle_request, tree);
   static void exported_binding_oracle (c_oracle_request, tree);
+  tree resolve_global (tree);
+  void define_inline (mapped_hash *, tree);
 
+  import *import_file (const char *filename,
+		       std::unique_ptr<npch_cache_request> request);
+  void enter_names (import *imp, const npch_file &npch);
+  void link_bases (mapped_hash *map);
   void pragma_import_pch ();
   static void exported_pragma_import_pch (cpp_reader *);
 
+  void define_macros (import *imp, const npch_file &npch);
+  void forget_macros (import *imp);
+  bool builtin_macro (cpp_reader *, cpp_hashnode *);
+  static bool exported_builtin_macro (cpp_reader *, cpp_hashnode *);
+  void undef (cpp_reader *, source_location, cpp_hashnode *);
+  static void exported_undef (cpp_reader *, source_location,
+			      cpp_hashnode *);
+
   void mark ();
   static void exported_mark (void *, void *);
 
+  void finish ();
+  static void exported_finish (void *, void *);
+  void report_stats ();
+
   static void init_pragmas (void *, void *);
 
   static pch_plugin *singleton;
 
-  std::list<std::unique_ptr<mapped_hash>> maps;
+  // Imports in the order they were requested.
+  std::list<import> imports;
+  // True if every import has been collected.
+  bool all_loaded;
+
+  // The import of each file by device and inode, so that importing
+  // the same file twice is harmless, and so that a base shared by
+  // several imports is only mapped once.
+  std::map<std::pair<dev_t, ino_t>, import *> imported_files;
+
+  // The names exported by all the imports.
+  merged_index index;
+  // Identifiers that resolve_global bound before the front end asked
+  // for them.
+  std::set<tree> resolved_identifiers;
+
+  duplicate_policy duplicates;
+  stale_policy stale;
+
+  // True if the stats argument was given.
+  bool show_stats;
+  // The number of names the front end asked the oracle about, and
+  // how many of them no import binds.
+  size_t oracle_queries;
+  size_t oracle_misses;
+
+  // The npch_config of this compilation, computed on first use.
+  std::string config;
+
+  // The cache directory, or empty if there is none.
+  std::string cache_dir;
+  std::string plugin_name;
+  std::string plugin_path;
+
+  // The madvise policy used for the constant pool of imported files.
+  mapped_file::access_policy pool_policy;
+  // How imported files are checked before use.
+  npch_validation validation;
+
+  // The imported macros that have not been read yet, with the import
+  // and the record that define each.
+  std::unordered_map<cpp_hashnode *, std::pair<import *, uint32_t>>
+    lazy_macros;
+
+  // The libcpp hooks that were installed before ours.
+  bool (*next_builtin_macro) (cpp_reader *, cpp_hashnode *);
+  void (*next_undef) (cpp_reader *, source_location, cpp_hashnode *);
 };
 
 #endif // NPCH_PCH_PLUGIN_HH
@@ -6,22 +6,31 @@
 #include <cstdlib>
 #include <string.h>
 #include <memory>
+#include <chrono>
 #include "stringpool.h"
+#include "stor-layout.h"
+#include "attribs.h"
+#include "ggc.h"
 #include "tree.h"
-#include "version.hh"
+#include "tree-iterator.h"
+#include "real.h"
+#include "format.hh"
+#include "util.hh"
 
 class pointer_iterator
 {
 public:
 
-  pointer_iterator (const uint8_t *data, size_t length)
-    : m_p (data), m_data (data), m_end (data + length)
+  // If TRUSTED, the record is known to be well formed, so reads are
+  // not bounds checked; see npch_file::validate.
+  pointer_iterator (const uint8_t *data, size_t length, bool trusted)
+    : m_p (data), m_data (data), m_end (data + length), m_trusted (trusted)
   {
   }
 
   uint8_t operator* () const
   {
-    assert (m_p >= m_data && m_p < m_end);
+    assert (m_trusted || (m_p >= m_data && m_p < m_end));
     return *m_p;
   }
 
@@ -31,50 +40,51 @@ public:
     return m_p >= m_data && m_p < m_end;
   }
 
-  const char *read_string ()
+  // Read a signed integer that must fit in an int.
+  bool read_int (int *result)
   {
-    assert (m_p >= m_data && m_p < m_end);
-    const char *result = (const char *) m_p;
-    // FIXME could overflow here.
-    m_p += strlen (result) + 1;
-    if (m_p < m_data || m_p >= m_end)
-      return nullptr;
-    return result;
+    int64_t val;
+    if (!read_sint (&val) || val != int (val))
+      return false;
+    *result = val;
+    return true;
   }
 
-  bool read_int (int *result)
+  bool read_sint (int64_t *result)
   {
-    if (m_p + 3 >= m_end)
+    uint64_t val;
+    if (!read_uint (&val))
       return false;
-    *result = 0;
-    for (int i = 3; i >= 0; --i)
+    *result = npch_unzigzag (val);
+    return true;
+  }
+
+  bool read_uint (uint64_t *result)
+  {
+    if (m_trusted)
       {
-	*result <<= 8;
-	*result |= m_p[i] & 0xff;
+	*result = npch_decode_uint_unchecked (&m_p);
+	return true;
       }
-    m_p += 4;
-    return true;
+    return npch_decode_uint (&m_p, m_end, result);
   }
 
   char read_char ()
   {
-    if (m_p >= m_end)
+    if (!m_trusted && m_p >= m_end)
       return 0;
     return *m_p++;
   }
 
-  bool read_uhwi (unsigned HOST_WIDE_INT *result)
+  size_t get_offset () const
   {
-    if (m_p + sizeof (*result) - 1 >= m_end)
-      return false;
-    memcpy (result, m_p, sizeof (*result));
-    m_p += sizeof (*result);
-    return true;
+    return m_p - m_data;
   }
 
-  size_t get_offset () const
+  // The number of bytes left to read.
+  size_t remaining () const
   {
-    return m_p - m_data;
+    return m_end - m_p;
   }
 
 private:
@@ -82,12 +92,44 @@ private:
   const uint8_t *m_p;
   const uint8_t *m_data;
   const uint8_t *m_end;
+  bool m_trusted;
+};
+
+// Charge the time until destruction to STATS, unless an outer
+// read_timer already does; reading one record often reads others.
+
+class read_timer
+{
+public:
+
+  read_timer (mapped_hash::statistics &stats, int &depth)
+    : m_stats (stats),
+      m_depth (depth)
+  {
+    if (m_depth++ == 0)
+      m_start = std::chrono::steady_clock::now ();
+  }
+
+  ~read_timer ()
+  {
+    if (--m_depth == 0)
+      m_stats.read_ns
+	+= std::chrono::duration_cast<std::chrono::nanoseconds>
+	     (std::chrono::steady_clock::now () - m_start).count ();
+  }
+
+private:
+
+  mapped_hash::statistics &m_stats;
+  int &m_depth;
+  std::chrono::steady_clock::time_point m_start;
 };
 
-mapped_hash::mapped_hash (const uint8_t *data, size_t length)
-  : m_data (data),
-    m_length (length),
-    trees (nullptr)
+mapped_hash::mapped_hash (std::unique_ptr<mapped_file> file)
+  : m_file (std::move (file)),
+    m_npch (m_file->data (), m_file->size ()),
+    trees (nullptr),
+    read_depth (0)
 {
 }
 
@@ -97,69 +139,86 @@ mapped_hash::~mapped_hash ()
 }
 
 bool
-mapped_hash::init ()
+mapped_hash::init (mapped_file::access_policy pool_policy)
 {
-  pointer_iterator iter (m_data, m_length);
+  if (!m_npch.init ())
+    return false;
 
-  int version;
-  if (!iter.read_int (&version) || version != PCH_PLUGIN_VERSION)
-    {
-      fprintf (stderr, "[version fail]\n");
-      return false;
-    }
+  // The directories are probed on every oracle query, so ask for
+  // them up front.
+  size_t offset, length;
+  m_npch.get_section (NPCH_SECTION_SYMBOLS, &offset, &length);
+  m_file->advise (mapped_file::ACCESS_WILLNEED, offset, length);
+  m_npch.get_section (NPCH_SECTION_TAGS, &offset, &length);
+  m_file->advise (mapped_file::ACCESS_WILLNEED, offset, length);
+  m_npch.get_section (NPCH_SECTION_POOL, &offset, &length);
+  m_file->advise (pool_policy, offset, length);
 
-  for (int i = 0; i < 2; ++i)
-    {
-      hash_map &the_map = (i == 0) ? symbols : tags;
-      while (true)
-	{
-	  const char *str = iter.read_string ();
-	  if (*str == '\0')
-	    break;
-
-	  int offset;
-	  if (!iter.read_int (&offset))
-	    return false;
-
-	  the_map[str] = offset;
-	}
-    }
-
-  cpool_offset = iter.get_offset ();
-  n_trees = m_length - cpool_offset + 1;
-  // Memory overkill.
+  m_bases.resize (m_npch.bases ().size (), nullptr);
+  n_trees = m_npch.num_records ();
   trees = new tree[n_trees];
   memset (trees, 0, n_trees * sizeof (tree));
   return true;
 }
 
 tree
-mapped_hash::find (c_oracle_request kind, const char *name)
+mapped_hash::find (c_oracle_request kind, tree identifier)
 {
   if (kind != C_ORACLE_SYMBOL && kind != C_ORACLE_TAG)
     return NULL_TREE;
 
-  hash_map &lookup = (kind == C_ORACLE_TAG) ? tags : symbols;
-  auto iter = lookup.find (name);
-  if (iter == lookup.end ())
+  uint64_t id;
+  if (!m_npch.lookup (kind == C_ORACLE_TAG ? NPCH_DIRECTORY_TAGS
+		      : NPCH_DIRECTORY_SYMBOLS,
+		      IDENTIFIER_HASH_VALUE (identifier),
+		      IDENTIFIER_POINTER (identifier),
+		      IDENTIFIER_LENGTH (identifier), &id))
     return NULL_TREE;
-  return find_type ((*iter).second);
+  return find_type (id);
 }
 
 void
 mapped_hash::mark ()
 {
-  for (size_t i = 0; i < n_trees; ++i)
-    ggc_mark (trees[i]);
+  for (tree t : instantiated)
+    ggc_mark (t);
+  // A shape that has been replaced must stay alive, or another tree
+  // could take its place and seem to match.
+  for (const auto &entry : origins)
+    ggc_mark (entry.second.shape);
+}
+
+// Read a string table reference and return the corresponding
+// identifier, NULL_TREE for the empty string, or error_mark_node.
+
+tree
+mapped_hash::read_name (pointer_iterator &iter)
+{
+  uint64_t ref;
+  const char *str;
+  size_t len;
+  uint32_t hash;
+  if (!iter.read_uint (&ref) || ref > UINT32_MAX
+      || !m_npch.get_string (ref, &str, &len, &hash))
+    return error_mark_node;
+  if (len == 0)
+    return NULL_TREE;
+
+  // The file records the identifier hash, so there is no need to
+  // compute it again.
+  hashnode node = ht_lookup_with_hash (ident_hash,
+				       (const unsigned char *) str, len,
+				       hash, HT_ALLOC);
+  return HT_IDENT_TO_GCC_IDENT (node);
 }
 
 tree
 mapped_hash::read_index_get_type (pointer_iterator &iter)
 {
-  int i;
-  if (!iter.read_int (&i))
+  uint64_t id;
+  if (!iter.read_uint (&id))
     return error_mark_node;
-  return find_type (i);
+  return find_type (id);
 }
 
 tree
@@ -180,11 +239,13 @@ mapped_hash::read_float_type (pointer_iterator &iter)
   int size_in_bytes;
   if (!iter.read_int (&size_in_bytes))
     return error_mark_node;
-  if (BITS_PER_UNIT * size_in_bytes == TYPE_PRECISION (float_type_node))
+  // The writer records int_size_in_bytes, which is not always the
+  // same as the precision; long double, for example.
+  if (size_in_bytes == int_size_in_bytes (float_type_node))
     return float_type_node;
-  if (BITS_PER_UNIT * size_in_bytes == TYPE_PRECISION (double_type_node))
+  if (size_in_bytes == int_size_in_bytes (double_type_node))
     return double_type_node;
-  if (BITS_PER_UNIT * size_in_bytes == TYPE_PRECISION (long_double_type_node))
+  if (size_in_bytes == int_size_in_bytes (long_double_type_node))
     return long_double_type_node;
   return error_mark_node;
 }
@@ -224,9 +285,81 @@ mapped_hash::read_function_type (pointer_iterator &iter)
     result = build_function_type_array (return_type, num_args,
 					argument_types.get ());
 
+  tree attrs = read_attributes (iter);
+  if (attrs == error_mark_node)
+    return error_mark_node;
+  if (attrs != NULL_TREE)
+    result = build_type_attribute_variant (result, attrs);
   return result;
 }
 
+// Read a list of attributes; see hash_writer::emit_attributes.  The
+// result is the list the front end would have built, ready for
+// decl_attributes or build_type_attribute_variant.
+
+tree
+mapped_hash::read_attributes (pointer_iterator &iter)
+{
+  int count;
+  if (!iter.read_int (&count) || count < 0)
+    return error_mark_node;
+
+  tree attrs = NULL_TREE;
+  for (int i = 0; i < count; ++i)
+    {
+      tree name = read_name (iter);
+      int n_args;
+      if (name == NULL_TREE || name == error_mark_node
+	  || !iter.read_int (&n_args) || n_args < 0)
+	return error_mark_node;
+
+      tree args = NULL_TREE;
+      for (int j = 0; j < n_args; ++j)
+	{
+	  tree arg;
+	  switch (iter.read_char ())
+	    {
+	    case 'i':
+	      {
+		int64_t value;
+		if (!iter.read_sint (&value))
+		  return error_mark_node;
+		arg = build_int_cst (integer_type_node, value);
+	      }
+	      break;
+
+	    case 's':
+	      {
+		uint64_t ref;
+		const char *str;
+		size_t len;
+		uint32_t hash;
+		if (!iter.read_uint (&ref) || ref > UINT32_MAX
+		    || !m_npch.get_string (ref, &str, &len, &hash))
+		  return error_mark_node;
+		// Include the NUL, as the lexer does.
+		arg = build_string (len + 1, str);
+		TREE_TYPE (arg) = build_array_type_nelts (char_type_node,
+							  len + 1);
+	      }
+	      break;
+
+	    case 'n':
+	      arg = read_name (iter);
+	      if (arg == NULL_TREE || arg == error_mark_node)
+		return error_mark_node;
+	      break;
+
+	    default:
+	      return error_mark_node;
+	    }
+	  args = tree_cons (NULL_TREE, arg, args);
+	}
+      attrs = tree_cons (name, nreverse (args), attrs);
+    }
+  return nreverse (attrs);
+}
+
 tree
 mapped_hash::read_array_type (pointer_iterator &iter)
 {
@@ -242,6 +375,27 @@ mapped_hash::read_array_type (pointer_iterator &iter)
     return build_array_type_nelts (element_type, num_elements);
 }
 
+tree
+mapped_hash::read_vector_type (pointer_iterator &iter)
+{
+  int num_elements;
+  if (!iter.read_int (&num_elements) || num_elements <= 0)
+    return error_mark_node;
+  tree element_type = read_index_get_type (iter);
+  if (element_type == error_mark_node)
+    return error_mark_node;
+  return build_vector_type (element_type, num_elements);
+}
+
+tree
+mapped_hash::read_complex_type (pointer_iterator &iter)
+{
+  tree element_type = read_index_get_type (iter);
+  if (element_type == error_mark_node)
+    return error_mark_node;
+  return build_complex_type (element_type);
+}
+
 tree
 mapped_hash::read_qualified_type (pointer_iterator &iter)
 {
@@ -265,75 +419,193 @@ mapped_hash::read_enum_type (pointer_iterator &iter)
   if (size < 0)
     size = -size;
 
+  // Give the type the range and layout of the integer type it is
+  // compatible with, before building the constants in it.
+  tree base = c_common_type_for_size (BITS_PER_UNIT * size, is_unsigned);
+  if (base == NULL_TREE)
+    return error_mark_node;
   tree result = make_node (ENUMERAL_TYPE);
-  TYPE_PRECISION (result) = size;
+  TYPE_PRECISION (result) = TYPE_PRECISION (base);
   TYPE_UNSIGNED (result) = is_unsigned;
+  TYPE_MIN_VALUE (result) = TYPE_MIN_VALUE (base);
+  TYPE_MAX_VALUE (result) = TYPE_MAX_VALUE (base);
+  layout_type (result);
 
   for (int i = 0; i < num_elements; ++i)
     {
-      const char *name = iter.read_string ();
-      if (name == nullptr)
+      tree name = read_name (iter);
+      if (name == NULL_TREE || name == error_mark_node)
 	return error_mark_node;
 
-      unsigned HOST_WIDE_INT value;
-      if (!iter.read_uhwi (&value))
-	return error_mark_node;
-      tree cst = (is_unsigned ? build_int_cstu (result, value)
-		  : build_int_cst (result, value));
-      tree decl = build_decl (BUILTINS_LOCATION /* FIXME */,
-			      CONST_DECL, get_identifier (name), result);
-      DECL_INITIAL (decl) = cst;
-      // pushdecl_safe (decl);
-      tree cons = tree_cons (DECL_NAME (decl), cst, TYPE_VALUES (result));
-      TYPE_VALUES (result) = cons;
+      // As in finish_enum, a constant that fits in int has type int.
+      tree cst;
+      if (is_unsigned)
+	{
+	  uint64_t value;
+	  if (!iter.read_uint (&value))
+	    return error_mark_node;
+	  if (value <= uint64_t (INT_MAX))
+	    cst = build_int_cst (integer_type_node, value);
+	  else
+	    cst = build_int_cstu (result, value);
+	}
+      else
+	{
+	  int64_t value;
+	  if (!iter.read_sint (&value))
+	    return error_mark_node;
+	  cst = build_int_cst (value >= INT_MIN && value <= INT_MAX
+			       ? integer_type_node : result, value);
+	}
+      // The CONST_DECLs are only made when a constant is looked up;
+      // see pch_plugin::binding_oracle.
+      TYPE_VALUES (result) = tree_cons (name, cst, TYPE_VALUES (result));
     }
+  TYPE_VALUES (result) = nreverse (TYPE_VALUES (result));
   return result;
 }
 
-tree
-mapped_hash::read_bitfield_type (pointer_iterator &iter)
-{
-  int bitsize;
-  if (!iter.read_int (&bitsize))
-    return error_mark_node;
-#if fixme
-  return c_build_bitfield_integer_type (bitsize, fixme);
-#else
-  return error_mark_node;
-#endif
-}
+// See hash_writer::write_struct_or_union_type for the layout.  This
+// does what finish_struct does with the fields the parser found.
 
 tree
 mapped_hash::read_struct_or_union_type (pointer_iterator &iter, int type_index,
 					bool is_struct)
 {
-  int num_fields;
-  if (!iter.read_int (&num_fields))
+  int flags, size, align, num_fields;
+  if (!iter.read_int (&flags) || !iter.read_int (&size)
+      || !iter.read_int (&align) || !iter.read_int (&num_fields))
     return error_mark_node;
 
   assert (trees[type_index] == NULL_TREE);
-  trees[type_index] = make_node (is_struct ? RECORD_TYPE : UNION_TYPE);
+  tree result = make_node (is_struct ? RECORD_TYPE : UNION_TYPE);
+  trees[type_index] = result;
+  std::vector<HOST_WIDE_INT> offsets;
   for (int i = 0; i < num_fields; ++i)
     {
-      const char *field_name = iter.read_string ();
-      if (field_name == nullptr)
+      tree name = read_name (iter);
+      if (name == error_mark_node)
 	return error_mark_node;
       tree field_type = read_index_get_type (iter);
       if (field_type == error_mark_node)
 	return error_mark_node;
+      int width, field_flags, field_align;
+      int64_t offset;
+      if (!iter.read_int (&width) || !iter.read_int (&field_flags)
+	  || !iter.read_int (&field_align) || !iter.read_sint (&offset))
+	return error_mark_node;
+      offsets.push_back (offset);
 
-      tree name = *field_name == '\0' ? NULL_TREE : get_identifier (field_name);
       tree decl = build_decl (BUILTINS_LOCATION /* FIXME */, FIELD_DECL,
 			      name, field_type);
-      DECL_FIELD_CONTEXT (decl) = trees[type_index];
+      DECL_FIELD_CONTEXT (decl) = result;
+      DECL_PACKED (decl) = (field_flags & 1) != 0;
+      if ((field_flags & 2) != 0)
+	{
+	  SET_DECL_ALIGN (decl, field_align);
+	  DECL_USER_ALIGN (decl) = 1;
+	}
+      if (width >= 0)
+	{
+	  DECL_SIZE (decl) = bitsize_int (width);
+	  DECL_BIT_FIELD (decl) = 1;
+	  SET_DECL_C_BIT_FIELD (decl);
+	}
 
-      DECL_CHAIN (decl) = TYPE_FIELDS (trees[type_index]);
-      TYPE_FIELDS (trees[type_index]) = decl;
+      DECL_CHAIN (decl) = TYPE_FIELDS (result);
+      TYPE_FIELDS (result) = decl;
     }
 
   /* We built the field list in reverse order, so fix it now.  */
-  TYPE_FIELDS (trees[type_index]) = nreverse (TYPE_FIELDS (trees[type_index]));
-  return trees[type_index];
+  TYPE_FIELDS (result) = nreverse (TYPE_FIELDS (result));
+
+  // Variants made while reading the fields, such as a const version
+  // for a pointer to this type, need the fields too.  layout_type
+  // takes care of their size.
+  for (tree x = TYPE_NEXT_VARIANT (result); x; x = TYPE_NEXT_VARIANT (x))
+    TYPE_FIELDS (x) = TYPE_FIELDS (result);
+
+  if ((flags & 4) == 0)
+    return result;
+
+  TYPE_PACKED (result) = (flags & 1) != 0;
+  if ((flags & 2) != 0)
+    {
+      SET_TYPE_ALIGN (result, align);
+      TYPE_USER_ALIGN (result) = 1;
+    }
+  layout_type (result);
+
+  // As in finish_struct, a bitfield gets a type of its own width once
+  // it has been laid out.
+  size_t i = 0;
+  for (tree field = TYPE_FIELDS (result); field;
+       field = DECL_CHAIN (field), ++i)
+    {
+      if (DECL_C_BIT_FIELD (field))
+	{
+	  unsigned HOST_WIDE_INT width = tree_to_uhwi (DECL_SIZE (field));
+	  tree type = TREE_TYPE (field);
+	  if (width != TYPE_PRECISION (type))
+	    {
+	      TREE_TYPE (field)
+		= c_build_bitfield_integer_type (width, TYPE_UNSIGNED (type));
+	      SET_DECL_MODE (field, TYPE_MODE (TREE_TYPE (field)));
+	    }
+	}
+
+      // Anything the writer knew about but this reader does not,
+      // such as an attribute it dropped, could change the layout.
+      // Better to refuse the type than to get it wrong.
+      if (int_bit_position (field) != offsets[i])
+	return error_mark_node;
+    }
+  if (int_size_in_bytes (result) != size || int (TYPE_ALIGN (result)) != align)
+    return error_mark_node;
+
+  return result;
+}
+
+// Read a location; see format.hh.  The line maps only grow, so a
+// location in another file is made the way libcc1 does it for GDB:
+// enter the file at that line, and leave it again straight away.
+
+bool
+mapped_hash::read_location (pointer_iterator &iter, location_t *loc)
+{
+  uint64_t ref;
+  int line;
+  if (!iter.read_uint (&ref) || ref > UINT32_MAX || !iter.read_int (&line)
+      || line == INT_MIN)
+    return false;
+  if (ref == 0)
+    {
+      *loc = BUILTINS_LOCATION;
+      return true;
+    }
+
+  uint64_t key = (ref << 32) | uint32_t (line);
+  auto found = locations.find (key);
+  if (found != locations.end ())
+    {
+      *loc = (*found).second;
+      return true;
+    }
+
+  // The string stays mapped for the rest of the compilation, so the
+  // line maps can point at it.
+  const char *file;
+  size_t len;
+  uint32_t hash;
+  if (!m_npch.get_string (ref, &file, &len, &hash))
+    return false;
+  bool sysp = line < 0;
+  linemap_add (line_table, LC_ENTER, sysp, file, sysp ? -line : line);
+  linemap_line_start (line_table, sysp ? -line : line, 0);
+  *loc = linemap_position_for_column (line_table, 0);
+  linemap_add (line_table, LC_LEAVE, false, nullptr, 0);
+  locations[key] = *loc;
+  return true;
 }
 
 tree
@@ -342,17 +614,25 @@ mapped_hash::read_symbol (pointer_iterator &iter)
   char what = iter.read_char ();
   if (!what)
     return error_mark_node;
-  const char *symname = iter.read_string ();
-  if (symname == nullptr)
+  tree symname = read_name (iter);
+  if (symname == NULL_TREE || symname == error_mark_node)
     return error_mark_node;
   tree type = read_index_get_type (iter);
-  if (type == error_mark_node)
+  tree asm_name = read_name (iter);
+  int flags;
+  location_t loc;
+  if (type == error_mark_node || asm_name == error_mark_node
+      || !iter.read_int (&flags) || !read_location (iter, &loc))
+    return error_mark_node;
+  tree attrs = read_attributes (iter);
+  if (attrs == error_mark_node)
     return error_mark_node;
 
   tree_code code;
   switch (what)
     {
     case 'f':
+    case 'i':
       code = FUNCTION_DECL;
       break;
     case 'v':
@@ -365,8 +645,27 @@ mapped_hash::read_symbol (pointer_iterator &iter)
       return error_mark_node;
     }
 
-  return build_decl (BUILTINS_LOCATION /* FIXME */, code,
-		     get_identifier (symname), type);
+  tree decl = build_decl (loc, code, symname, type);
+  // Only inline functions get an 'i', and handle_gnu_inline_attribute
+  // drops gnu_inline from a function that is not yet marked inline.
+  DECL_DECLARED_INLINE_P (decl) = what == 'i';
+  TREE_THIS_VOLATILE (decl) = (flags & 1) != 0;
+  TREE_READONLY (decl) = (flags & 2) != 0;
+  if (code != TYPE_DECL)
+    {
+      if (asm_name != NULL_TREE)
+	SET_DECL_ASSEMBLER_NAME (decl, asm_name);
+      if (attrs != NULL_TREE)
+	decl_attributes (&decl, attrs, 0);
+    }
+  if (what == 'i')
+    {
+      uint64_t body;
+      if (!iter.read_uint (&body))
+	return error_mark_node;
+      bodies[decl] = body;
+    }
+  return decl;
 }
 
 tree
@@ -385,32 +684,634 @@ mapped_hash::read_basic (pointer_iterator &iter, int idx)
       return read_function_type (iter);
     case '[':
       return read_array_type (iter);
+    case 'v':
+      return read_vector_type (iter);
+    case 'c':
+      return read_complex_type (iter);
     case 'q':
       return read_qualified_type (iter);
     case 'e':
       return read_enum_type (iter);
-    case ':':
-      return read_bitfield_type (iter);
     case '{':
     case '|':
       return read_struct_or_union_type (iter, idx, c == '{');
     case 'S':
       return read_symbol (iter);
-    case 'V':
-      return void_type_node;
+    case 'X':
+      return read_external (iter);
     }
 
   return error_mark_node;
 }
 
+// An 'X' record stands for a record of one of the bases.
+
+tree
+mapped_hash::read_external (pointer_iterator &iter)
+{
+  uint64_t base, id;
+  if (!iter.read_uint (&base) || !iter.read_uint (&id)
+      || base >= m_bases.size () || m_bases[base] == nullptr)
+    return error_mark_node;
+  return m_bases[base]->find_type (id);
+}
+
+// What of T the rest of the compilation may change in place: the
+// size of a type, which a forward declaration of a struct gets when
+// it is completed, or the type of a declaration, which a later
+// declaration can make composite, as with an extern array given its
+// size.
+
+static tree
+origin_shape (tree t)
+{
+  return TYPE_P (t) ? TYPE_SIZE (t) : TREE_TYPE (t);
+}
+
+bool
+mapped_hash::origin (tree t, uint64_t *record)
+{
+  auto iter = origins.find (t);
+  if (iter == origins.end () || !unchanged_p (t))
+    return false;
+  *record = (*iter).second.record;
+  return true;
+}
+
+// True if T still matches the record it was read from, as does
+// everything it refers to from this file.  A tree this file did not
+// make is taken as it is.
+
+bool
+mapped_hash::unchanged_p (tree t)
+{
+  auto iter = origins.find (t);
+  if (iter == origins.end ())
+    return true;
+  auto known = unchanged.find (t);
+  if (known != unchanged.end ())
+    return (*known).second;
+
+  // Assume the best while looking, so that a struct that points to
+  // itself terminates.
+  unchanged[t] = true;
+  bool ok = origin_shape (t) == (*iter).second.shape;
+  if (ok && TYPE_P (t) && TYPE_QUALS (t))
+    ok = unchanged_p (TYPE_MAIN_VARIANT (t));
+  else if (ok)
+    switch (TREE_CODE (t))
+      {
+      case POINTER_TYPE:
+      case ARRAY_TYPE:
+      case COMPLEX_TYPE:
+      case VECTOR_TYPE:
+      case FUNCTION_DECL:
+      case VAR_DECL:
+      case TYPE_DECL:
+	ok = unchanged_p (TREE_TYPE (t));
+	break;
+
+      case FUNCTION_TYPE:
+	ok = unchanged_p (TREE_TYPE (t));
+	for (tree arg = TYPE_ARG_TYPES (t); ok && arg; arg = TREE_CHAIN (arg))
+	  ok = unchanged_p (TREE_VALUE (arg));
+	break;
+
+      case RECORD_TYPE:
+      case UNION_TYPE:
+	for (tree field = TYPE_FIELDS (t); ok && field;
+	     field = DECL_CHAIN (field))
+	  {
+	    tree type = DECL_BIT_FIELD_TYPE (field);
+	    ok = unchanged_p (type != NULL_TREE ? type : TREE_TYPE (field));
+	  }
+	break;
+
+      default:
+	break;
+      }
+
+  unchanged[t] = ok;
+  return ok;
+}
+
 tree
-mapped_hash::find_type (size_t idx)
+mapped_hash::find_type (size_t id)
 {
+  if (id < NPCH_FIRST_RECORD)
+    return builtin_type_node (id);
+
+  size_t idx = id - NPCH_FIRST_RECORD;
+  if (idx >= n_trees)
+    return error_mark_node;
   if (!trees[idx])
     {
-      pointer_iterator iter (m_data, m_length);
-      iter.advance(cpool_offset + idx);
+      // Inflating the record's block counts as reading it.
+      read_timer timer (m_stats, read_depth);
+      const uint8_t *data;
+      size_t length;
+      if (!m_npch.get_record (id, &data, &length) || length == 0)
+	return error_mark_node;
+      uint8_t tag = data[0];
+      ++m_stats.records[tag];
+      pointer_iterator iter (data, length, m_npch.trusted ());
       trees[idx] = read_basic (iter, idx);
+      instantiated.push_back (trees[idx]);
+      if (tag != 'X' && trees[idx] != error_mark_node)
+	origins.emplace (trees[idx],
+			 origin_entry { id, origin_shape (trees[idx]) });
     }
   return trees[idx];
 }
+
+// See hash_writer::write_macro for the layout.  This is the same
+// structure _cpp_create_definition would build from the text of the
+// definition, so libcpp cannot tell the difference.
+
+cpp_macro *
+mapped_hash::read_macro (size_t id)
+{
+  read_timer timer (m_stats, read_depth);
+  const uint8_t *data;
+  size_t length;
+  if (!m_npch.get_record (id, &data, &length))
+    return nullptr;
+  ++m_stats.records['M'];
+  pointer_iterator iter (data, length, m_npch.trusted ());
+
+  int paramc, count;
+  if (iter.read_char () != 'M')
+    return nullptr;
+  char flags = iter.read_char ();
+  location_t loc;
+  if (!read_location (iter, &loc)
+      || !iter.read_int (&paramc) || paramc < 0 || paramc > USHRT_MAX)
+    return nullptr;
+
+  cpp_macro *macro = ggc_cleared_alloc<cpp_macro> ();
+  macro->line = loc;
+  macro->fun_like = (flags & 1) != 0;
+  macro->variadic = (flags & 2) != 0;
+  macro->paramc = paramc;
+  macro->params = ggc_vec_alloc<cpp_hashnode *> (paramc);
+  for (int i = 0; i < paramc; ++i)
+    {
+      tree name = read_name (iter);
+      if (name == NULL_TREE || name == error_mark_node)
+	return nullptr;
+      macro->params[i] = CPP_HASHNODE (GCC_IDENT_TO_HT_IDENT (name));
+    }
+
+  if (!iter.read_int (&count) || count < 0)
+    return nullptr;
+  macro->count = count;
+  macro->exp.tokens = ggc_cleared_vec_alloc<cpp_token> (count);
+  for (int i = 0; i < count; ++i)
+    {
+      cpp_token &token = macro->exp.tokens[i];
+      unsigned char type = iter.read_char ();
+      char kind = iter.read_char ();
+      int token_flags;
+      if (type >= N_TTYPES || !iter.read_int (&token_flags))
+	return nullptr;
+      token.type = cpp_ttype (type);
+      token.flags = token_flags;
+      // Only the line of the definition is kept, which is as much as
+      // a diagnostic about an expansion usually shows anyway.
+      token.src_loc = loc;
+
+      switch (kind)
+	{
+	case 'n':
+	  {
+	    tree name = read_name (iter);
+	    if (name == NULL_TREE || name == error_mark_node)
+	      return nullptr;
+	    token.val.node.node = CPP_HASHNODE (GCC_IDENT_TO_HT_IDENT (name));
+	    token.val.node.spelling = token.val.node.node;
+	  }
+	  break;
+
+	case 's':
+	  {
+	    uint64_t ref;
+	    const char *str;
+	    size_t len;
+	    uint32_t hash;
+	    if (!iter.read_uint (&ref) || ref > UINT32_MAX
+		|| !m_npch.get_string (ref, &str, &len, &hash))
+	      return nullptr;
+	    token.val.str.len = len;
+	    token.val.str.text
+	      = (const unsigned char *) ggc_alloc_string (str, len);
+	  }
+	  break;
+
+	case 'a':
+	  {
+	    int arg;
+	    if (!iter.read_int (&arg) || arg < 1 || arg > paramc)
+	      return nullptr;
+	    token.val.macro_arg.arg_no = arg;
+	    token.val.macro_arg.spelling = macro->params[arg - 1];
+	  }
+	  break;
+
+	case '-':
+	  break;
+
+	default:
+	  return nullptr;
+	}
+    }
+
+  return macro;
+}
+
+// The state of reading one function body.
+struct mapped_hash::body_state
+{
+  tree fndecl;
+  // Every numbered node read so far.
+  std::vector<tree> nodes;
+  // The BLOCK of the innermost BIND_EXPR being read, and the
+  // outermost one, which becomes DECL_INITIAL of the function.
+  tree block;
+  tree outer_block;
+  const std::function<tree (tree)> *resolve;
+  // How deeply the item being read is nested.
+  unsigned depth;
+};
+
+// Set the flags of T from FLAGS, a set of npch_node_flag bits.
+
+static void
+set_node_flags (tree t, int flags)
+{
+  TREE_SIDE_EFFECTS (t) = (flags & NPCH_NODE_SIDE_EFFECTS) != 0;
+  TREE_THIS_VOLATILE (t) = (flags & NPCH_NODE_VOLATILE) != 0;
+  TREE_READONLY (t) = (flags & NPCH_NODE_READONLY) != 0;
+  TREE_CONSTANT (t) = (flags & NPCH_NODE_CONSTANT) != 0;
+  TREE_ADDRESSABLE (t) = (flags & NPCH_NODE_ADDRESSABLE) != 0;
+  TREE_USED (t) = (flags & NPCH_NODE_USED) != 0;
+  TREE_NO_WARNING (t) = (flags & NPCH_NODE_NO_WARNING) != 0;
+  if (DECL_P (t))
+    {
+      DECL_ARTIFICIAL (t) = (flags & NPCH_NODE_ARTIFICIAL) != 0;
+      DECL_IGNORED_P (t) = (flags & NPCH_NODE_IGNORED) != 0;
+      if (TREE_CODE (t) == VAR_DECL || TREE_CODE (t) == PARM_DECL)
+	DECL_REGISTER (t) = (flags & NPCH_NODE_REGISTER) != 0;
+    }
+}
+
+// Read a node of a body into *RESULT; see hash_writer::write_body.
+
+bool
+mapped_hash::read_item (pointer_iterator &iter, body_state &state,
+			tree *result)
+{
+  // A trusted file has been checked against this already.
+  if (state.depth >= NPCH_MAX_ITEM_DEPTH)
+    return false;
+  nesting level (state.depth);
+
+  char kind = iter.read_char ();
+  switch (kind)
+    {
+    case 'N':
+      *result = NULL_TREE;
+      return true;
+
+    case 'x':
+      {
+	int index;
+	if (!iter.read_int (&index) || index < 0
+	    || size_t (index) >= state.nodes.size ())
+	  return false;
+	*result = state.nodes[index];
+	return true;
+      }
+
+    case 'G':
+      {
+	tree name = read_name (iter);
+	if (name == NULL_TREE || name == error_mark_node)
+	  return false;
+	*result = (*state.resolve) (name);
+	return *result != NULL_TREE && *result != error_mark_node;
+      }
+
+    case 'F':
+      {
+	tree type = read_index_get_type (iter);
+	int index;
+	if (type == error_mark_node || !RECORD_OR_UNION_TYPE_P (type)
+	    || !iter.read_int (&index) || index < 0)
+	  return false;
+	tree field = TYPE_FIELDS (type);
+	for (; field != NULL_TREE && index > 0; --index)
+	  field = DECL_CHAIN (field);
+	*result = field;
+	return field != NULL_TREE;
+      }
+
+    case 'I':
+      {
+	tree type = read_index_get_type (iter);
+	uint64_t value;
+	if (type == error_mark_node || !iter.read_uint (&value))
+	  return false;
+	// The writer stored the low word, which build_int_cst_type
+	// extends or truncates according to the type.
+	HOST_WIDE_INT low = value;
+	*result = build_int_cst_type (type, low);
+	return true;
+      }
+
+    case 'R':
+      {
+	tree type = read_index_get_type (iter);
+	uint64_t ref;
+	const char *str;
+	size_t len;
+	uint32_t hash;
+	if (type == error_mark_node || !SCALAR_FLOAT_TYPE_P (type)
+	    || !iter.read_uint (&ref) || ref > UINT32_MAX
+	    || !m_npch.get_string (ref, &str, &len, &hash))
+	  return false;
+	REAL_VALUE_TYPE value;
+	real_from_string (&value, str);
+	*result = build_real (type, value);
+	return true;
+      }
+
+    case 'T':
+      {
+	tree type = read_index_get_type (iter);
+	int len;
+	if (type == error_mark_node || !iter.read_int (&len) || len < 0)
+	  return false;
+	std::string bytes;
+	for (int i = 0; i < len; ++i)
+	  {
+	    if (iter.remaining () == 0)
+	      return false;
+	    bytes.push_back (iter.read_char ());
+	  }
+	*result = build_string (len, bytes.data ());
+	TREE_TYPE (*result) = type;
+	return true;
+      }
+
+    case 'D':
+      {
+	int code, flags;
+	if (!iter.read_int (&code) || !iter.read_int (&flags))
+	  return false;
+	tree name = read_name (iter);
+	tree type = read_index_get_type (iter);
+	location_t loc;
+	if (name == error_mark_node || type == error_mark_node
+	    || !read_location (iter, &loc))
+	  return false;
+	switch (code)
+	  {
+	  case VAR_DECL:
+	  case PARM_DECL:
+	  case RESULT_DECL:
+	  case LABEL_DECL:
+	  case TYPE_DECL:
+	    break;
+	  default:
+	    return false;
+	  }
+
+	tree decl = build_decl (loc, tree_code (code), name, type);
+	DECL_CONTEXT (decl) = state.fndecl;
+	if (code == PARM_DECL)
+	  DECL_ARG_TYPE (decl) = type;
+	set_node_flags (decl, flags);
+	state.nodes.push_back (decl);
+
+	tree init;
+	if (!read_item (iter, state, &init))
+	  return false;
+	if (code == VAR_DECL)
+	  DECL_INITIAL (decl) = init;
+	*result = decl;
+	return true;
+      }
+
+    case 'L':
+      {
+	int count;
+	if (!iter.read_int (&count) || count < 0)
+	  return false;
+	tree list = alloc_stmt_list ();
+	state.nodes.push_back (list);
+	for (int i = 0; i < count; ++i)
+	  {
+	    tree stmt;
+	    if (!read_item (iter, state, &stmt))
+	      return false;
+	    if (stmt != NULL_TREE)
+	      append_to_statement_list_force (stmt, &list);
+	  }
+	*result = list;
+	return true;
+      }
+
+    case 'b':
+      {
+	int flags, count;
+	tree type = NULL_TREE;
+	if (!iter.read_int (&flags))
+	  return false;
+	if ((flags & NPCH_NODE_HAS_TYPE) != 0)
+	  {
+	    type = read_index_get_type (iter);
+	    if (type == error_mark_node)
+	      return false;
+	  }
+	if (!iter.read_int (&count) || count < 0)
+	  return false;
+
+	tree bind = make_node (BIND_EXPR);
+	TREE_TYPE (bind) = type;
+	state.nodes.push_back (bind);
+
+	tree vars = NULL_TREE;
+	tree *tail = &vars;
+	for (int i = 0; i < count; ++i)
+	  {
+	    tree var;
+	    if (!read_item (iter, state, &var) || var == NULL_TREE
+		|| !DECL_P (var) || DECL_CONTEXT (var) != state.fndecl)
+	      return false;
+	    *tail = var;
+	    tail = &DECL_CHAIN (var);
+	  }
+
+	tree block = make_node (BLOCK);
+	BLOCK_VARS (block) = vars;
+	if (state.block == NULL_TREE)
+	  {
+	    BLOCK_SUPERCONTEXT (block) = state.fndecl;
+	    if (state.outer_block == NULL_TREE)
+	      state.outer_block = block;
+	  }
+	else
+	  {
+	    BLOCK_SUPERCONTEXT (block) = state.block;
+	    BLOCK_SUBBLOCKS (state.block)
+	      = block_chainon (BLOCK_SUBBLOCKS (state.block), block);
+	  }
+
+	tree saved = state.block;
+	state.block = block;
+	tree body;
+	bool ok = read_item (iter, state, &body);
+	state.block = saved;
+	if (!ok)
+	  return false;
+
+	BIND_EXPR_VARS (bind) = vars;
+	BIND_EXPR_BODY (bind) = body;
+	BIND_EXPR_BLOCK (bind) = block;
+	set_node_flags (bind, flags);
+	*result = bind;
+	return true;
+      }
+
+    case 'E':
+      {
+	int code, flags, count;
+	tree type = NULL_TREE;
+	if (!iter.read_int (&code) || code < 0 || code >= MAX_TREE_CODES
+	    || !iter.read_int (&flags))
+	  return false;
+	if ((flags & NPCH_NODE_HAS_TYPE) != 0)
+	  {
+	    type = read_index_get_type (iter);
+	    if (type == error_mark_node)
+	      return false;
+	  }
+	if (!iter.read_int (&count) || count < 0)
+	  return false;
+
+	tree_code tcode = tree_code (code);
+	tree t;
+	int first = 0;
+	switch (TREE_CODE_CLASS (tcode))
+	  {
+	  case tcc_vl_exp:
+	    // Each operand takes at least a byte.
+	    if (size_t (count) > iter.remaining ())
+	      return false;
+	    t = build_vl_exp (tcode, count + 1);
+	    first = 1;
+	    break;
+	  case tcc_expression:
+	  case tcc_unary:
+	  case tcc_binary:
+	  case tcc_comparison:
+	  case tcc_reference:
+	  case tcc_statement:
+	    if (tcode == BIND_EXPR || count != TREE_CODE_LENGTH (tcode))
+	      return false;
+	    t = make_node (tcode);
+	    break;
+	  default:
+	    return false;
+	  }
+
+	TREE_TYPE (t) = type;
+	state.nodes.push_back (t);
+	for (int i = 0; i < count; ++i)
+	  {
+	    tree op;
+	    if (!read_item (iter, state, &op))
+	      return false;
+	    TREE_OPERAND (t, first + i) = op;
+	  }
+	set_node_flags (t, flags);
+	*result = t;
+	return true;
+      }
+    }
+
+  return false;
+}
+
+bool
+mapped_hash::read_body (tree fndecl, const std::function<tree (tree)> &resolve)
+{
+  auto found = bodies.find (fndecl);
+  if (found == bodies.end ())
+    return false;
+  uint64_t id = (*found).second;
+  bodies.erase (found);
+
+  read_timer timer (m_stats, read_depth);
+  const uint8_t *data;
+  size_t length;
+  if (!m_npch.get_record (id, &data, &length))
+    return false;
+  ++m_stats.records['B'];
+  pointer_iterator iter (data, length, m_npch.trusted ());
+
+  int flags, n_parms;
+  if (iter.read_char () != 'B' || !iter.read_int (&flags))
+    return false;
+
+  body_state state;
+  state.fndecl = fndecl;
+  state.block = NULL_TREE;
+  state.outer_block = NULL_TREE;
+  state.resolve = &resolve;
+  state.depth = 0;
+
+  tree result;
+  if (!read_item (iter, state, &result)
+      || (result != NULL_TREE && TREE_CODE (result) != RESULT_DECL)
+      || !iter.read_int (&n_parms) || n_parms < 0)
+    return false;
+
+  tree parms = NULL_TREE;
+  tree *tail = &parms;
+  for (int i = 0; i < n_parms; ++i)
+    {
+      tree parm;
+      if (!read_item (iter, state, &parm) || parm == NULL_TREE
+	  || TREE_CODE (parm) != PARM_DECL)
+	return false;
+      *tail = parm;
+      tail = &DECL_CHAIN (parm);
+    }
+
+  tree body;
+  if (!read_item (iter, state, &body))
+    return false;
+
+  if (result == NULL_TREE)
+    {
+      result = build_decl (DECL_SOURCE_LOCATION (fndecl), RESULT_DECL,
+			   NULL_TREE, TREE_TYPE (TREE_TYPE (fndecl)));
+      DECL_CONTEXT (result) = fndecl;
+    }
+  if (state.outer_block == NULL_TREE)
+    {
+      state.outer_block = make_node (BLOCK);
+      BLOCK_SUPERCONTEXT (state.outer_block) = fndecl;
+    }
+
+  DECL_RESULT (fndecl) = result;
+  DECL_ARGUMENTS (fndecl) = parms;
+  DECL_SAVED_TREE (fndecl) = body;
+  DECL_INITIAL (fndecl) = state.outer_block;
+  TREE_STATIC (fndecl) = 1;
+  TREE_PUBLIC (fndecl) = (flags & 1) != 0;
+  DECL_EXTERNAL (fndecl) = (flags & 2) != 0;
+  DECL_DECLARED_INLINE_P (fndecl) = (flags & 4) != 0;
+  return true;
+}
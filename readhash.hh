@@ -9,8 +9,14 @@
 #include "tree.h"
 #include <cstdint>
 #include <cstddef>
+#include <memory>
 #include <unordered_map>
+#include <vector>
+#include <functional>
 #include "c-tree.h"
+#include "cpp-id-data.h"
+#include "mapfile.hh"
+#include "npchfile.hh"
 
 class pointer_iterator;
 
@@ -18,20 +24,133 @@ class mapped_hash
 {
 public:
 
-  mapped_hash (const uint8_t *data, size_t length);
+  // Counts kept for the stats plugin argument.
+  struct statistics
+  {
+    statistics ()
+      : hits (0), read_ns (0), records ()
+    {
+    }
+
+    // Oracle queries answered from this file.
+    size_t hits;
+    // Time spent reading records, in nanoseconds.
+    uint64_t read_ns;
+    // The number of records read, indexed by their tag byte.
+    size_t records[256];
+  };
+
+  explicit mapped_hash (std::unique_ptr<mapped_file> file);
   ~mapped_hash ();
 
-  // Find a binding for NAME and KIND in this map.  If none is found,
-  // return NULL_TREE.
-  tree find (c_oracle_request kind, const char *name);
+  // Find a binding for IDENTIFIER and KIND in this map.  If none is
+  // found, return NULL_TREE.
+  tree find (c_oracle_request kind, tree identifier);
+
+  // Instantiate the record with the given ID.  Returns
+  // error_mark_node if it cannot be read.
+  tree find_type (size_t id);
+
+  // Build the macro whose record has the given ID, in GC memory.
+  // Returns null if it cannot be read.
+  cpp_macro *read_macro (size_t id);
+
+  // True if FNDECL, which was instantiated from this map, is an
+  // inline function whose body has not been read yet.
+  bool has_body (tree fndecl) const
+  {
+    return bodies.count (fndecl) != 0;
+  }
+
+  // Read the body of FNDECL and attach it, so that the function is
+  // ready for cgraph_node::finalize_function.  RESOLVE returns the
+  // declaration of a global that the body names.  Returns false if
+  // the body cannot be read.
+  bool read_body (tree fndecl, const std::function<tree (tree)> &resolve);
+
+  // Call FN with the hash, name, name length and record ID of each
+  // entry of the directory WHICH.  This does not touch GCC state, so
+  // it may be called from a worker thread.
+  void for_each_entry (npch_directory which,
+		       const std::function<void (uint32_t, const char *,
+						 size_t, uint32_t)> &fn)
+  {
+    m_npch.for_each_entry (which, fn);
+  }
+
+  // Return the Bloom filter of the directory WHICH in *BITS and its
+  // size in *LOG2.
+  void get_filter (npch_directory which, const uint8_t **bits,
+		   uint32_t *log2) const
+  {
+    m_npch.get_filter (which, bits, log2);
+  }
+
+  // Check that the file is not corrupt; see npch_file::validate.
+  // This may be called from a worker thread.
+  bool validate (npch_validation mode, std::string *reason)
+  {
+    return m_npch.validate (mode, reason);
+  }
+
+  // Check that the file is not stale; see npch_file::check_manifest.
+  // This may be called from a worker thread.
+  bool check_manifest (const std::string &config, std::string *reason) const
+  {
+    return m_npch.check_manifest (config, reason);
+  }
+
+  // The parsed file.
+  const npch_file &npch () const
+  {
+    return m_npch;
+  }
+
+  // The files this one is layered on; see format.hh.
+  const std::vector<npch_base> &bases () const
+  {
+    return m_npch.bases ();
+  }
+
+  // Read the records of base I from BASE.
+  void set_base (size_t i, mapped_hash *base)
+  {
+    m_bases[i] = base;
+  }
+
+  // The checksum from the header.
+  uint64_t checksum () const
+  {
+    return m_npch.checksum ();
+  }
+
+  // If T was instantiated from a record of this file, other than a
+  // reference to a base, and neither it nor what it refers to has
+  // changed since, set *RECORD to its ID and return true.  This is
+  // only asked once the compilation is done, and the answer is kept.
+  bool origin (tree t, uint64_t *record);
 
   // GC mark.
   void mark ();
 
-  bool init ();
+  statistics &stats ()
+  {
+    return m_stats;
+  }
+
+  // The size of the mapped file.
+  size_t mapped_size () const
+  {
+    return m_file->size ();
+  }
+
+  // Read the directory.  POOL_POLICY is the madvise policy to use
+  // for the constant pool.
+  bool init (mapped_file::access_policy pool_policy);
 
 private:
 
+  tree read_name (pointer_iterator &iter);
   tree read_index_get_type (pointer_iterator &iter);
   tree read_int_type (pointer_iterator &iter);
   tree read_float_type (pointer_iterator &iter);
@@ -40,41 +159,60 @@ private:
   tree read_array_type (pointer_iterator &iter);
   tree read_qualified_type (pointer_iterator &iter);
   tree read_enum_type (pointer_iterator &iter);
-  tree read_bitfield_type (pointer_iterator &iter);
+  tree read_vector_type (pointer_iterator &iter);
+  tree read_complex_type (pointer_iterator &iter);
+  tree read_attributes (pointer_iterator &iter);
+  bool read_location (pointer_iterator &iter, location_t *loc);
   tree read_struct_or_union_type (pointer_iterator &, int, bool);
   tree read_symbol (pointer_iterator &iter);
+  tree read_external (pointer_iterator &iter);
   tree read_basic (pointer_iterator &iter, int idx);
-  tree find_type (size_t idx);
+  struct body_state;
+  bool read_item (pointer_iterator &iter, body_state &state, tree *result);
 
-  // The underlying data.  FIXME maybe a better ..
-  const uint8_t *m_data;
-  size_t m_length;
-
-  size_t cpool_offset;
+  // The underlying mapping, and the file in it.
+  std::unique_ptr<mapped_file> m_file;
+  npch_file m_npch;
 
+  // The tree for each record, indexed by record ID less
+  // NPCH_FIRST_RECORD, or NULL_TREE if it has not been instantiated
+  // yet.
   tree *trees;
   size_t n_trees;
 
-  struct hasher
-  {
-    std::size_t operator () (const char *a) const
-    {
-      return htab_hash_string (a);
-    }
-  };
+  // Every tree that has been instantiated, so that GC marking only
+  // costs as much as what was actually used.
+  std::vector<tree> instantiated;
 
-  struct equal
+  // The locations made by read_location, keyed by the string
+  // reference of the file and the line as stored.
+  std::unordered_map<uint64_t, location_t> locations;
+
+  // The map of each base, or null if it has not been set.
+  std::vector<mapped_hash *> m_bases;
+
+  // The record each instantiated tree was read from, so that a file
+  // written by this compilation can refer to it instead of copying
+  // it, and its shape then; see origin_shape.
+  struct origin_entry
   {
-    bool operator () (const char *a, const char *b) const
-    {
-      return strcmp (a, b) == 0;
-    }
+    uint64_t record;
+    tree shape;
   };
+  std::unordered_map<tree, origin_entry> origins;
+  // Whether each tree in ORIGINS still matches its record.
+  std::unordered_map<tree, bool> unchanged;
+
+  bool unchanged_p (tree);
 
-  typedef std::unordered_map<const char *, size_t, hasher, equal> hash_map;
+  statistics m_stats;
+  // How many reads of records are in progress, so that a record that
+  // reads others is only timed once.
+  int read_depth;
 
-  hash_map symbols;
-  hash_map tags;
+  // The body record of each inline function that has been
+  // instantiated but not used yet.
+  std::unordered_map<tree, uint64_t> bodies;
 };
 
 #endif // NPCH_READHASH_HH
@@ -0,0 +1,18 @@
+#include "include/hidden.h"
+
+/* Only what is declared here is exported, but struct hidden is still
+   written, unnamed, for shown to use.  */
+extern int shown (struct hidden *);
+
+struct visible
+{
+  struct hidden inner;
+};
+
+/* hidden_count is not bound by the file, so this is only exported as
+   a declaration.  */
+extern inline __attribute__ ((gnu_inline)) int
+shown_count (struct visible *v)
+{
+  return hidden_count (&v->inner);
+}
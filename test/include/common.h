@@ -0,0 +1,6 @@
+/* Included by both simple-test.c and other-test.c, so that linking
+   their files binds these names to the same records.  */
+
+extern int common_value (int);
+
+#define COMMON_LIMIT 8
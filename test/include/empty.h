@@ -0,0 +1 @@
+/* Declares nothing, but can still be imported.  */
@@ -0,0 +1,8 @@
+/* Included by filtered-test.c, but outside its export pattern.  */
+
+struct hidden
+{
+  int count;
+};
+
+extern int hidden_count (struct hidden *);
@@ -0,0 +1,18 @@
+#pragma GCC import_pch "test/file.npch"
+
+struct holder
+{
+  struct flags flags;
+  enum level level;
+};
+
+extern int count_flags (struct flags *, int);
+
+/* This completes the struct later from file.npch in place, so it
+   must be written out again rather than referred to.  */
+struct later
+{
+  int value;
+};
+
+extern struct later current_later;
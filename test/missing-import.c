@@ -0,0 +1,3 @@
+#pragma GCC import_pch "test/missing.npch"
+
+int unused;
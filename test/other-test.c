@@ -0,0 +1,14 @@
+#include "include/common.h"
+
+/* The same as in simple-test.c, so npch-link merges the two.  */
+struct flags
+{
+  unsigned int ready : 1;
+  unsigned int mode : 3;
+  int count;
+} __attribute__ ((packed));
+
+/* A different definition of a name simple-test.c defines.  */
+#define SOME_CONSTANT 43
+
+extern int other_function (struct flags *);
@@ -1 +1,57 @@
+#include "include/common.h"
+
 extern void some_function (void);
+
+#define SOME_CONSTANT 42
+#define CALL_IT(f) f ()
+
+static inline int
+add_one (int x)
+{
+  /* Neither STEP nor result is visible outside add_one.  */
+  enum { STEP = 1 };
+  int result = x + STEP;
+  return result;
+}
+
+struct flags
+{
+  unsigned int ready : 1;
+  unsigned int mode : 3;
+  int count;
+} __attribute__ ((packed));
+
+extern void fatal (const char *, ...)
+  __attribute__ ((noreturn, format (printf, 1, 2)));
+
+typedef int v4si __attribute__ ((vector_size (16)));
+extern _Complex double root (v4si);
+
+extern inline __attribute__ ((gnu_inline)) int
+twice (int x)
+{
+  return x * 2;
+}
+
+struct pair { int a, b; } __attribute__ ((aligned (16)));
+
+/* Completed by layered-test.c.  */
+struct later;
+
+enum { MODE_OFF, MODE_ON = 5 };
+enum level { LEVEL_LOW = -1, LEVEL_HIGH = 1 };
+
+/* The asm keeps ping from being exported with its body, so pong,
+   which calls it, must not be either.  */
+static inline int ping (int);
+static inline int
+pong (int n)
+{
+  return n > 0 ? ping (n - 1) : 0;
+}
+static inline int
+ping (int n)
+{
+  __asm__ ("");
+  return n > 0 ? pong (n - 1) : 1;
+}
@@ -0,0 +1,4 @@
+#pragma GCC import_pch "include/hidden.h"
+#pragma GCC import_pch "include/empty.h"
+
+int count (struct hidden *h) { return hidden_count (h) + h->count; }
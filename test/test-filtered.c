@@ -0,0 +1,3 @@
+#pragma GCC import_pch "test/filtered.npch"
+
+int total (struct visible *v) { return shown (&v->inner) + shown_count (v); }
@@ -0,0 +1,9 @@
+#pragma GCC import_pch "test/layered.npch"
+
+int ready (struct holder *h) { return h->flags.ready && h->flags.mode == 5; }
+
+int count (struct holder *h) { return count_flags (&h->flags, LEVEL_HIGH); }
+
+int same (struct flags *f, struct holder *h) { return f == &h->flags; }
+
+int later_value (void) { return current_later.value; }
@@ -1,3 +1,21 @@
 #pragma GCC import_pch "test/file.npch"
 
-void f (void) { some_function (); }
+void f (void) { CALL_IT (some_function); }
+
+int g (void) { return SOME_CONSTANT; }
+
+int h (int x) { return add_one (x); }
+
+int ready (struct flags *f) { return f->ready && f->mode == 5; }
+
+void die (void) { fatal ("%d\n", SOME_CONSTANT); }
+
+int mode_on (struct flags *f) { return f->mode == MODE_ON; }
+
+int high (int x) { return x == LEVEL_HIGH ? LEVEL_LOW : 0; }
+
+_Complex double solve (v4si v) { return root (v); }
+
+int quadruple (int x) { return twice (twice (x)); }
+
+_Static_assert (_Alignof (struct pair) == 16, "struct pair is aligned");
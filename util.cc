@@ -1,3 +1,10 @@
+#include "util.hh"
+#include "c-tree.h"
+#include "format.hh"
+#include "stor-layout.h"
+#include "version.h"
+#include "opts.h"
+#include "toplev.h"
 
 void
 pushdecl_safe (tree decl)
@@ -7,3 +14,162 @@ pushdecl_safe (tree decl)
   pushdecl (decl);
   c_binding_oracle = save;
 }
+
+// The nodes for the builtin record IDs, in order.  These are
+// pointers because the nodes themselves are not set up until the
+// front end starts.
+static tree *const builtin_nodes[NPCH_FIRST_RECORD] =
+{
+  &void_type_node,
+  &boolean_type_node,
+  &char_type_node,
+  &signed_char_type_node,
+  &unsigned_char_type_node,
+  &short_integer_type_node,
+  &short_unsigned_type_node,
+  &integer_type_node,
+  &unsigned_type_node,
+  &long_integer_type_node,
+  &long_unsigned_type_node,
+  &long_long_integer_type_node,
+  &long_long_unsigned_type_node,
+  &float_type_node,
+  &double_type_node,
+  &long_double_type_node,
+};
+
+tree
+builtin_type_node (unsigned id)
+{
+  gcc_assert (id < NPCH_FIRST_RECORD);
+  return *builtin_nodes[id];
+}
+
+int
+builtin_type_id (tree type)
+{
+  // An aligned or attributed variant is not the builtin type, even
+  // though its main variant is.
+  if (!TYPE_P (type) || TYPE_QUALS (type) || TYPE_USER_ALIGN (type)
+      || TYPE_ATTRIBUTES (type) != NULL_TREE)
+    return -1;
+
+  type = TYPE_MAIN_VARIANT (type);
+  for (int i = 0; i < NPCH_FIRST_RECORD; ++i)
+    if (type == *builtin_nodes[i])
+      return i;
+  return -1;
+}
+
+// True if ARG starts with one of the N prefixes in PREFIXES.
+
+static bool
+has_prefix_p (const char *arg, const char *const *prefixes, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    if (strncmp (arg, prefixes[i], strlen (prefixes[i])) == 0)
+      return true;
+  return false;
+}
+
+// True if the option ARG changes what a header declares.  Include
+// paths are left out, as the manifest records which headers were
+// read, and so are options that change the ABI, which the type
+// summary in npch_config covers.  Optimization and output options
+// must not matter, or a file written with --syntax-only would never
+// be imported by a compilation with -c.  If SEARCH, also accept the
+// options that a compilation of the same header needs to find the
+// same files and lay out types the same way.
+
+static bool
+parse_option_p (const char *arg, bool search)
+{
+  static const char *const declaring[] =
+  {
+    "-D", "-U", "-include", "-imacros", "-std", "-ansi", "-undef"
+  };
+  static const char *const searching[] =
+  {
+    "-I", "-isystem", "-iquote", "-idirafter", "-nostdinc", "-m", "-f"
+  };
+  static const char *const excluded[] =
+  {
+    "-fplugin", "-fdump", "-fdiagnostics", "-fpreprocessed",
+    "-fsyntax-only"
+  };
+
+  if (has_prefix_p (arg, declaring, ARRAY_SIZE (declaring)))
+    return true;
+  return (search
+	  && has_prefix_p (arg, searching, ARRAY_SIZE (searching))
+	  && !has_prefix_p (arg, excluded, ARRAY_SIZE (excluded)));
+}
+
+std::vector<std::string>
+parse_options (bool search)
+{
+  std::vector<std::string> options;
+  for (unsigned i = 0; i < save_decoded_options_count; ++i)
+    {
+      const cl_decoded_option &opt = save_decoded_options[i];
+      if (opt.canonical_option_num_elements == 0
+	  || !parse_option_p (opt.canonical_option[0], search))
+	continue;
+      for (size_t j = 0; j < opt.canonical_option_num_elements; ++j)
+	options.push_back (opt.canonical_option[j]);
+    }
+  return options;
+}
+
+std::string
+npch_config ()
+{
+  std::string result = "gcc ";
+  result += version_string;
+
+  char buf[64];
+  for (int i = 0; i < NPCH_FIRST_RECORD; ++i)
+    {
+      tree type = *builtin_nodes[i];
+      snprintf (buf, sizeof (buf), " %d:%d/%d", i,
+		int (TYPE_PRECISION (type)), int (TYPE_ALIGN (type)));
+      result += buf;
+    }
+
+  snprintf (buf, sizeof (buf), " ptr:%d/%d wchar:%d%s",
+	    int (TYPE_PRECISION (ptr_type_node)),
+	    int (TYPE_ALIGN (ptr_type_node)),
+	    int (TYPE_PRECISION (wchar_type_node)),
+	    TYPE_UNSIGNED (wchar_type_node) ? "u" : "s");
+  result += buf;
+  snprintf (buf, sizeof (buf), " char:%s short-enums:%d pack:%d",
+	    TYPE_UNSIGNED (char_type_node) ? "unsigned" : "signed",
+	    int (flag_short_enums), int (maximum_field_alignment));
+  result += buf;
+
+  // A header parsed with other macros or language standard may well
+  // declare something else.
+  for (const std::string &option : parse_options (false))
+    {
+      result += ' ';
+      result += option;
+    }
+  return result;
+}
+
+std::string
+absolute_path (const char *filename)
+{
+  std::string path;
+  if (!IS_ABSOLUTE_PATH (filename))
+    {
+      char *cwd = getpwd ();
+      if (cwd != nullptr)
+	{
+	  path = cwd;
+	  path += '/';
+	}
+    }
+  path += filename;
+  return path;
+}
@@ -1,2 +1,76 @@
+// Miscellaneous helpers.
+
+#ifndef NPCH_UTIL_HH
+#define NPCH_UTIL_HH
+
+#include "gcc-plugin.h"
+#include "system.h"
+#include "coretypes.h"
+#include "tree.h"
+#include <string>
+#include <vector>
+
+// GCC 7 turned these fields into setters.
+#ifndef SET_TYPE_ALIGN
+#define SET_TYPE_ALIGN(NODE, X) (TYPE_ALIGN (NODE) = (X))
+#endif
+#ifndef SET_DECL_ALIGN
+#define SET_DECL_ALIGN(NODE, X) (DECL_ALIGN (NODE) = (X))
+#endif
+#ifndef SET_DECL_MODE
+#define SET_DECL_MODE(NODE, MODE) (DECL_MODE (NODE) = (MODE))
+#endif
 
 void pushdecl_safe (tree decl);
+
+// Count one more level of nesting in DEPTH for as long as this
+// lives.
+
+class nesting
+{
+public:
+
+  explicit nesting (unsigned &depth)
+    : m_depth (depth)
+  {
+    ++m_depth;
+  }
+
+  ~nesting ()
+  {
+    --m_depth;
+  }
+
+  nesting (const nesting &) = delete;
+  nesting &operator= (const nesting &) = delete;
+
+private:
+
+  unsigned &m_depth;
+};
+
+// Return the type that the builtin record ID stands for; see
+// npch_builtin in format.hh.  ID must be below NPCH_FIRST_RECORD.
+tree builtin_type_node (unsigned id);
+
+// Return the builtin record ID for TYPE, or -1 if it has none.
+int builtin_type_id (tree type);
+
+// The options of this compilation that change what a header
+// declares, such as -D, -std and -include, each split into its
+// elements; these are part of npch_config.  If SEARCH, also the
+// options that affect which headers are found and how types are laid
+// out, such as -I and -m; these are passed on when generating a
+// cached import, and are part of its key.
+std::vector<std::string> parse_options (bool search);
+
+// Describe the compiler, the parts of the target ABI that the records
+// of a .npch file depend on, and the options from parse_options
+// (false).  A file is only imported by a compilation with the same
+// description.
+std::string npch_config ();
+
+// Return FILENAME made absolute, relative to the current directory.
+std::string absolute_path (const char *filename);
+
+#endif // NPCH_UTIL_HH
@@ -1,15 +1,44 @@
 #include "writer.hh"
-#include "version.hh"
+#include "format.hh"
+#include "util.hh"
+#include "diagnostic-core.h"
+#include "c-family/c-common.h"
+#include "cpp-id-data.h"
+#include "tree-iterator.h"
+#include "real.h"
+#include "attribs.h"
+#include <fnmatch.h>
 #include <memory>
-#include "fclose_deleter.hh"
 
-hash_writer::hash_writer (const char *plugin_name, const char *filename)
-  : m_filename (filename)
+hash_writer::hash_writer (const char *plugin_name, const char *filename,
+			  int compression,
+			  const std::vector<std::string> &exports,
+			  npch_origin_function find_origin)
+  : m_filename (filename),
+    m_compression (compression),
+    m_find_origin (find_origin),
+    m_body_depth (0),
+    m_body_low (SIZE_MAX),
+    m_buffer (nullptr),
+    m_offset (0),
+    m_len (0)
 {
+  for (const std::string &pattern : exports)
+    {
+      export_patterns.push_back (pattern);
+      // A pattern such as "*/glib/*" already matches absolute paths.
+      if (!IS_ABSOLUTE_PATH (pattern.c_str ()) && pattern[0] != '*')
+	export_patterns.push_back (absolute_path (pattern.c_str ()));
+    }
+
   register_callback (plugin_name, PLUGIN_GGC_MARKING, exported_mark, this);
 
   register_callback (plugin_name, PLUGIN_FINISH_TYPE, exported_add, this);
   register_callback (plugin_name, PLUGIN_FINISH_DECL, exported_add, this);
+  // Function definitions do not go through finish_decl.
+  register_callback (plugin_name, PLUGIN_PRE_GENERICIZE, exported_add, this);
+  register_callback (plugin_name, PLUGIN_INCLUDE_FILE, exported_add_include,
+		     this);
   // Note that PLUGIN_FINISH_UNIT is not called with --syntax-only.
   register_callback (plugin_name, PLUGIN_FINISH, exported_finish, this);
 }
@@ -31,14 +60,94 @@ hash_writer::exported_mark (void *, void *self)
   writer->mark ();
 }
 
+// The location of the declaration of T, which is a declaration or a
+// type.
+
+static location_t
+declared_at (tree t)
+{
+  if (DECL_P (t))
+    return DECL_SOURCE_LOCATION (t);
+  tree decl = TYPE_STUB_DECL (t);
+  if (decl == NULL_TREE && TYPE_NAME (t) != NULL_TREE
+      && TREE_CODE (TYPE_NAME (t)) == TYPE_DECL)
+    decl = TYPE_NAME (t);
+  return decl != NULL_TREE ? DECL_SOURCE_LOCATION (decl) : UNKNOWN_LOCATION;
+}
+
+// True if PATTERN matches the file FILE: as a glob, where a "*" may
+// match a "/", or by naming FILE or a directory above it.
+
+static bool
+file_matches (const std::string &pattern, const std::string &file)
+{
+  if (fnmatch (pattern.c_str (), file.c_str (), 0) == 0)
+    return true;
+  size_t len = pattern.size ();
+  while (len > 1 && pattern[len - 1] == '/')
+    --len;
+  return (file.compare (0, len, pattern, 0, len) == 0
+	  && (file.size () == len || file[len] == '/'));
+}
+
+// True if a name declared at LOC should be exported.  Whatever is not
+// exported can still be written as a record that an exported name
+// refers to; it just gets no entry in the directories.
+
+bool
+hash_writer::exported_p (location_t loc)
+{
+  if (export_patterns.empty ())
+    return true;
+  if (loc <= BUILTINS_LOCATION)
+    return false;
+  const char *file = LOCATION_FILE (loc);
+  if (file == nullptr)
+    return false;
+
+  auto iter = exported_files.find (file);
+  if (iter != exported_files.end ())
+    return (*iter).second;
+
+  std::string spelled (file);
+  std::string absolute = absolute_path (file);
+  bool result = false;
+  for (const std::string &pattern : export_patterns)
+    if (file_matches (pattern, spelled) || file_matches (pattern, absolute))
+      {
+	result = true;
+	break;
+      }
+  exported_files[file] = result;
+  return result;
+}
+
+// True if T is declared at file scope.  Types and declarations local
+// to a function, such as those in the body of an inline function, are
+// not visible to an importer, and neither are the constants of a
+// local enum.
+
+static bool
+file_scope_p (tree t)
+{
+  if (TYPE_P (t))
+    t = TYPE_STUB_DECL (t);
+  return t == NULL_TREE || DECL_FILE_SCOPE_P (t);
+}
+
 void
 hash_writer::add (tree t)
 {
-  if ((TYPE_P (t) && TYPE_NAME (t))
-      || (DECL_P (t) && DECL_NAME (t)
-	  && (TREE_CODE (t) == FUNCTION_DECL
-	      || TREE_CODE (t) == VAR_DECL
-	      || TREE_CODE (t) == TYPE_DECL)))
+  // The constants of an enum are exported through it, so even an
+  // anonymous enum is worth keeping.
+  if (((TYPE_P (t) && TYPE_NAME (t))
+       || (TREE_CODE (t) == ENUMERAL_TYPE && TYPE_VALUES (t))
+       || (DECL_P (t) && DECL_NAME (t)
+	   && (TREE_CODE (t) == FUNCTION_DECL
+	       || TREE_CODE (t) == VAR_DECL
+	       || TREE_CODE (t) == TYPE_DECL)))
+      && file_scope_p (t)
+      && exported_p (declared_at (t)))
     inputs.push_back (t);
 }
 
@@ -52,52 +161,171 @@ hash_writer::exported_add (void *vt, void *self)
 }
 
 void
-hash_writer::do_fwrite (FILE *out, ssize_t val)
+hash_writer::add_include (const char *filename)
 {
-  char buf[4];
-
-  for (int i = 0; i < 4; ++i)
-    {
-      buf[i] = val & 0xff;
-      val >>= 8;
-    }
+  includes.push_back (filename);
+}
 
-  fwrite (buf, 4, 1, out);
+/* static */ void
+hash_writer::exported_add_include (void *filename, void *self)
+{
+  assert (self != nullptr);
+  hash_writer *writer = static_cast<hash_writer *> (self);
+  writer->add_include (static_cast<const char *> (filename));
 }
 
+// Add FILENAME to the manifest.  Paths are made absolute, since the
+// importer may well run in another directory.
+
 void
-hash_writer::do_fwrite (FILE *out, const char *data, size_t len)
+hash_writer::add_dependency (const char *filename)
+{
+  std::string path = absolute_path (filename);
+  npch_dependency dep;
+  if (npch_stat_dependency (path.c_str (), &dep, true))
+    m_builder.add_dependency (dep);
+  else
+    warning (0, "npch: could not record dependency %qs: %m",
+	     path.c_str ());
+}
+
+// Add NODE to the vector DATA if it is a macro that should be
+// exported: one defined by the source, rather than predefined or
+// given on the command line, and one the reader can rebuild.
+
+static int
+collect_macro (cpp_reader *, cpp_hashnode *node, void *data)
 {
-  fwrite (data, len, 1, out);
+  if (node->type != NT_MACRO || (node->flags & NODE_BUILTIN) != 0)
+    return 1;
+  const cpp_macro *macro = node->value.macro;
+  if (macro->traditional || macro->line <= BUILTINS_LOCATION)
+    return 1;
+  // Command-line definitions are in a pseudo-file such as
+  // "<command-line>".
+  const char *file = LOCATION_FILE (macro->line);
+  if (file == nullptr || file[0] == '<')
+    return 1;
+
+  for (unsigned i = 0; i < macro->count; ++i)
+    switch (cpp_token_val_index (&macro->exp.tokens[i]))
+      {
+      case CPP_TOKEN_FLD_NODE:
+      case CPP_TOKEN_FLD_STR:
+      case CPP_TOKEN_FLD_ARG_NO:
+      case CPP_TOKEN_FLD_NONE:
+	break;
+      default:
+	return 1;
+      }
+
+  static_cast<std::vector<cpp_hashnode *> *> (data)->push_back (node);
+  return 1;
 }
 
 void
 hash_writer::finish ()
 {
-  if (inputs.empty ())
-    return;
+  // Nothing tells a plugin about #define, so find the macros by
+  // walking the identifiers.
+  std::vector<cpp_hashnode *> macros;
+  cpp_forall_identifiers (parse_in, collect_macro, &macros);
+  size_t n_macros = 0;
+  for (cpp_hashnode *node : macros)
+    if (exported_p (node->value.macro->line))
+      macros[n_macros++] = node;
+  macros.resize (n_macros);
 
-  std::unique_ptr<FILE, fclose_deleter> out (fopen (m_filename.c_str (), "w"));
-  do_fwrite (out.get (), PCH_PLUGIN_VERSION);
+  // Even with nothing to export a file is written, so that a header
+  // that declares nothing, or only what the filter leaves out, can
+  // still be imported, through the cache for instance.
 
-  for (int i = 0; i < 2; ++i)
+  // A name may be seen more than once; the last one wins.
+  std::vector<std::pair<tree, ssize_t>> entries[2];
+  std::unordered_map<tree, size_t> seen[2];
+  auto bind = [&] (int i, tree name, ssize_t id)
     {
-      for (auto &iter : inputs)
+      auto found = seen[i].find (name);
+      if (found != seen[i].end ())
+	entries[i][(*found).second].second = id;
+      else
 	{
-	  if (!(i == 0 ? DECL_P (iter) : TYPE_P (iter)))
-	    continue;
-
-	  ssize_t pool_off = get (iter);
-	  tree name = DECL_P (iter) ? DECL_NAME (iter) : TYPE_NAME (iter);
-	  do_fwrite (out.get (), IDENTIFIER_POINTER (name),
-		     IDENTIFIER_LENGTH (name) + 1);
-	  do_fwrite (out.get (), pool_off);
+	  seen[i][name] = entries[i].size ();
+	  entries[i].push_back (std::make_pair (name, id));
 	}
+    };
+
+  for (auto &iter : inputs)
+    {
+      int i = DECL_P (iter) ? 0 : 1;
+      tree name = DECL_P (iter) ? DECL_NAME (iter) : TYPE_NAME (iter);
+      if (name != NULL_TREE && TREE_CODE (name) != IDENTIFIER_NODE)
+	continue;
+
+      if (!can_write (iter))
+	{
+	  tree decl = DECL_P (iter) ? iter : TYPE_STUB_DECL (iter);
+	  location_t loc = (decl != NULL_TREE ? DECL_SOURCE_LOCATION (decl)
+			    : input_location);
+	  if (name != NULL_TREE)
+	    warning_at (loc, 0, "npch: cannot export %qE", name);
+	  else
+	    warning_at (loc, 0, "npch: cannot export %qT", iter);
+	  continue;
+	}
+
+      ssize_t id = get (iter);
+      if (name != NULL_TREE)
+	bind (i, name, id);
+      // Each constant of an enum is bound to the enum itself, so
+      // that naming one instantiates just that enum.
+      if (TREE_CODE (iter) == ENUMERAL_TYPE)
+	for (tree value = TYPE_VALUES (iter); value;
+	     value = TREE_CHAIN (value))
+	  bind (0, TREE_PURPOSE (value), id);
+    }
+
+  // Now write out every record that was reached.  Writing a record
+  // can queue more.
+  while (!pending.empty ())
+    {
+      tree t = pending.front ().first;
+      const std::string *contents = pending.front ().second;
+      pending.pop_front ();
+      record_offsets[objects[t] - NPCH_FIRST_RECORD] = here ();
+      if (contents != nullptr)
+	emit (contents->data (), contents->size ());
+      else
+	write (t);
+    }
+
+  for (int i = 0; i < 2; ++i)
+    for (auto &entry : entries[i])
+      m_builder.add_entry (npch_directory (i), intern (entry.first),
+			   entry.second);
 
-      do_fwrite (out.get (), "", 1);
+  // A macro refers to no other record, so its record can simply
+  // follow the others.
+  for (cpp_hashnode *node : macros)
+    {
+      ssize_t id = NPCH_FIRST_RECORD + record_offsets.size ();
+      record_offsets.push_back (here ());
+      write_macro (node);
+      tree name = HT_IDENT_TO_GCC_IDENT (HT_NODE (node));
+      m_builder.add_entry (NPCH_DIRECTORY_MACROS, intern (name), id);
     }
 
-  do_fwrite (out.get (), m_buffer, m_offset);
+  m_builder.set_config (npch_config ());
+  add_dependency (main_input_filename);
+  for (auto &filename : includes)
+    add_dependency (filename.c_str ());
+
+  if (!m_builder.write (m_filename.c_str (), m_buffer, m_offset,
+			record_offsets, m_compression))
+    error ("npch: could not write %qs: %m", m_filename.c_str ());
+  else if (!m_builder.unvalidated ().empty ())
+    warning (0, "npch: %qs is not marked as validated: %s",
+	     m_filename.c_str (), m_builder.unvalidated ().c_str ());
 }
 
 /* static */ void
@@ -129,11 +357,7 @@ void
 hash_writer::write_pointer_type (tree t)
 {
   emit ('p');
-  ssize_t patch = here ();
-  emit (patch);
-
-  ssize_t base = get (TREE_TYPE (t));
-  emit_at (patch, base);
+  emit_ref (TREE_TYPE (t));
 }
 
 void
@@ -141,35 +365,40 @@ hash_writer::write_qualified_type (tree t)
 {
   emit ('q');
   emit (static_cast<ssize_t> (TYPE_QUALS (t)));
-  ssize_t patch = here ();
-  emit (patch);
-
-  ssize_t base = get (build_qualified_type (t, 0));
-  emit_at (patch, base);
+  emit_ref (build_qualified_type (t, 0));
 }
 
-void
-hash_writer::write_bitfield_type (tree t)
-{
-  emit (':');
-#if fixme
-  emit (FIXME);
-#endif
-}
+// An array whose bound is unknown or not constant is written as an
+// incomplete array.  At file scope, a VLA can only appear in a
+// prototype, where that is compatible.
 
 void
 hash_writer::write_array_type (tree t)
 {
   emit ('[');
   ssize_t len = -1;
-  if (TYPE_DOMAIN (t))
-    len = tree_to_shwi (TYPE_MAX_VALUE (TYPE_DOMAIN (t))) + 1;
+  tree domain = TYPE_DOMAIN (t);
+  if (domain != NULL_TREE && TYPE_MAX_VALUE (domain) != NULL_TREE
+      && tree_fits_shwi_p (TYPE_MAX_VALUE (domain)))
+    len = tree_to_shwi (TYPE_MAX_VALUE (domain)) + 1;
   emit (len);
-  ssize_t patch = here ();
-  emit (patch);
+  emit_ref (TREE_TYPE (t));
+}
+
+void
+hash_writer::write_vector_type (tree t)
+{
+  emit ('v');
+  emit (static_cast<ssize_t> (int_size_in_bytes (t)
+			      / int_size_in_bytes (TREE_TYPE (t))));
+  emit_ref (TREE_TYPE (t));
+}
 
-  ssize_t element = get (TREE_TYPE (t));
-  emit_at (patch, element);
+void
+hash_writer::write_complex_type (tree t)
+{
+  emit ('c');
+  emit_ref (TREE_TYPE (t));
 }
 
 void
@@ -188,10 +417,11 @@ hash_writer::write_enum_type (tree t)
   emit (n_csts);
   for (tree iter = TYPE_VALUES (t); iter; iter = TREE_CHAIN (iter))
     {
-      emit (IDENTIFIER_POINTER (TREE_PURPOSE (iter)));
-
-      unsigned HOST_WIDE_INT uhwi = tree_to_uhwi (TREE_VALUE (iter));
-      emit ((const char *) &uhwi, sizeof (uhwi));
+      emit_name (TREE_PURPOSE (iter));
+      if (TYPE_UNSIGNED (t))
+	emit_uint (tree_to_uhwi (TREE_VALUE (iter)));
+      else
+	emit (static_cast<ssize_t> (tree_to_shwi (TREE_VALUE (iter))));
     }
 }
 
@@ -214,28 +444,27 @@ hash_writer::write_function_type (tree t)
   emit ('(');
   emit (n_args);
   emit (is_varargs);
-  ssize_t patch = here ();
-  emit (patch);
-  for (tree iter = TYPE_ARG_TYPES (t); iter; iter = TREE_CHAIN (iter))
-    {
-      if (iter == void_list_node)
-	break;
-      emit (patch);
-    }
-
-  ssize_t ret_type = get (TREE_TYPE (t));
-  emit_at (patch, ret_type);
-  patch += 4;			// FIXME should be done elsewhere
-
+  emit_ref (TREE_TYPE (t));
   for (tree iter = TYPE_ARG_TYPES (t); iter; iter = TREE_CHAIN (iter))
     {
       if (iter == void_list_node)
 	break;
-      emit_at (patch, get (TREE_VALUE (iter)));
-      patch += 4;		// FIXME
+      emit_ref (TREE_VALUE (iter));
     }
+  // Attributes such as format and nonnull live on the type.
+  emit_attributes (TYPE_ATTRIBUTES (t));
 }
 
+// A struct or union record is a '{' or a '|'; flags, which have bit 0
+// set if the type is packed, bit 1 if its alignment was given by the
+// user and bit 2 if it is complete; its size in bytes; its alignment
+// in bits; and the number of fields.  Then, for each field, its name;
+// its type, which for a bitfield is the declared type; its width if
+// it is a bitfield, or -1; flags, with the same meaning as for the
+// type; its alignment; and its offset in bits.  The reader lays the
+// type out itself, and uses the sizes and offsets to check that it
+// came to the same answer.
+
 void
 hash_writer::write_struct_or_union_type (tree t)
 {
@@ -246,47 +475,643 @@ hash_writer::write_struct_or_union_type (tree t)
       ++n_elts;
     }
 
+  bool complete = COMPLETE_TYPE_P (t);
   emit (TREE_CODE (t) == RECORD_TYPE ? '{' : '|');
+  emit (static_cast<ssize_t> ((TYPE_PACKED (t) ? 1 : 0)
+			      | (TYPE_USER_ALIGN (t) ? 2 : 0)
+			      | (complete ? 4 : 0)));
+  emit (static_cast<ssize_t> (complete ? int_size_in_bytes (t) : -1));
+  emit (static_cast<ssize_t> (TYPE_ALIGN (t)));
   emit (n_elts);
 
-  ssize_t patch = here ();
   for (tree iter = TYPE_FIELDS (t); iter; iter = TREE_CHAIN (iter))
     {
-      if (DECL_NAME (iter))
-	emit (IDENTIFIER_POINTER (DECL_NAME (iter)));
+      tree type = DECL_BIT_FIELD_TYPE (iter);
+      ssize_t width = -1;
+      if (type != NULL_TREE)
+	width = tree_to_shwi (DECL_SIZE (iter));
       else
-	emit ("");
-      emit (patch);
-    }
+	type = TREE_TYPE (iter);
 
-  for (tree iter = TYPE_FIELDS (t); iter; iter = TREE_CHAIN (iter))
-    {
-      if (DECL_NAME (iter))
-	patch += IDENTIFIER_LENGTH (DECL_NAME (iter)) + 1;
-      else
-	++patch;
-      emit_at (patch, get (TREE_TYPE (iter)));
+      emit_name (DECL_NAME (iter));
+      emit_ref (type);
+      emit (width);
+      emit (static_cast<ssize_t> ((DECL_PACKED (iter) ? 1 : 0)
+				  | (DECL_USER_ALIGN (iter) ? 2 : 0)));
+      emit (static_cast<ssize_t> (DECL_ALIGN (iter)));
+      emit (static_cast<ssize_t> (complete ? int_bit_position (iter) : 0));
     }
 }
 
+// True if the body of the function T should be exported: it is an
+// inline function that the importer may need to define itself.  An
+// external definition would be defined twice once the importer was
+// linked with the header's own object file.
+
+static bool
+inline_body_p (tree t)
+{
+  return (DECL_SAVED_TREE (t) != NULL_TREE
+	  && DECL_DECLARED_INLINE_P (t)
+	  && (!TREE_PUBLIC (t) || DECL_EXTERNAL (t)));
+}
+
+// A symbol record is an 'S'; a byte saying what it is: 'f' a
+// function, 'i' an inline function, 'v' a variable or 't' a typedef;
+// its name; its type; its assembler name if one was given with asm,
+// or the empty string; flags, with bit 0 set if it is volatile, which
+// for a function means noreturn, and bit 1 if it is read-only; and
+// its attributes.  An inline function is followed by the ID of its
+// body record, which is only read if the function is used.  The
+// attributes of a typedef are not kept, since they have already
+// been applied to its type.
+
 void
 hash_writer::write_decl (tree t)
 {
+  ssize_t body = -1;
+  if (TREE_CODE (t) == FUNCTION_DECL && inline_body_p (t))
+    body = get_body (t);
+
+  tree asm_name = NULL_TREE;
+  if (TREE_CODE (t) != TYPE_DECL && DECL_ASSEMBLER_NAME_SET_P (t)
+      && DECL_ASSEMBLER_NAME (t) != DECL_NAME (t))
+    asm_name = DECL_ASSEMBLER_NAME (t);
 
   emit ('S');
-  emit (TREE_CODE (t) == FUNCTION_DECL ? 'f'
-	 : (TREE_CODE (t) == VAR_DECL ? 'v' : 't'));
-  emit (IDENTIFIER_POINTER (DECL_NAME (t)));
-  ssize_t patch = here ();
-  emit (patch);
+  if (TREE_CODE (t) == FUNCTION_DECL)
+    emit (body >= 0 ? 'i' : 'f');
+  else
+    emit (TREE_CODE (t) == VAR_DECL ? 'v' : 't');
+  emit_name (DECL_NAME (t));
+  emit_ref (TREE_TYPE (t));
+  emit_name (asm_name);
+  emit (static_cast<ssize_t> ((TREE_THIS_VOLATILE (t) ? 1 : 0)
+			      | (TREE_READONLY (t) ? 2 : 0)));
+  emit_location (DECL_SOURCE_LOCATION (t));
+  emit_attributes (TREE_CODE (t) == TYPE_DECL ? NULL_TREE
+		   : DECL_ATTRIBUTES (t));
+  if (body >= 0)
+    emit_uint (body);
+}
+
+// Emit the location LOC; see format.hh.
 
-  emit_at (patch, get (TREE_TYPE (t)));
+void
+hash_writer::emit_location (location_t loc)
+{
+  expanded_location x = expand_location (loc);
+  if (loc <= BUILTINS_LOCATION || x.file == nullptr)
+    {
+      emit_uint (0);
+      emit (ssize_t (0));
+      return;
+    }
+  size_t len = strlen (x.file);
+  emit_uint (m_builder.intern (x.file, len, npch_hash_string (x.file, len)));
+  emit (in_system_header_at (loc) ? -ssize_t (x.line) : ssize_t (x.line));
 }
 
+// True if every argument of the attribute ATTR is an integer, a
+// string or an identifier, which is all emit_attributes handles.
+
+static bool
+attribute_writable_p (tree attr)
+{
+  tree args = TREE_VALUE (attr);
+  if (args != NULL_TREE && TREE_CODE (args) != TREE_LIST)
+    return false;
+  for (; args != NULL_TREE; args = TREE_CHAIN (args))
+    {
+      tree arg = TREE_VALUE (args);
+      switch (TREE_CODE (arg))
+	{
+	case INTEGER_CST:
+	  if (!tree_fits_shwi_p (arg))
+	    return false;
+	  break;
+	case STRING_CST:
+	  // The string table cannot hold an embedded NUL.
+	  if (strlen (TREE_STRING_POINTER (arg)) + 1
+	      != size_t (TREE_STRING_LENGTH (arg)))
+	    return false;
+	  break;
+	case IDENTIFIER_NODE:
+	  break;
+	default:
+	  return false;
+	}
+    }
+  return true;
+}
+
+// True if what T's attributes and user alignment say is all kept by
+// its record.  A function type carries its attributes, and the layout
+// of a struct, union or enum already shows its packing and alignment.
+// Anything else, such as an aligned typedef of int or a may_alias
+// pointer, would be read back as the plain type.
+
+static bool
+type_attributes_written_p (tree t)
+{
+  bool aggregate = (TREE_CODE (t) == RECORD_TYPE
+		    || TREE_CODE (t) == UNION_TYPE
+		    || TREE_CODE (t) == ENUMERAL_TYPE);
+  if (TYPE_USER_ALIGN (t) && !aggregate)
+    return false;
+  for (tree attr = TYPE_ATTRIBUTES (t); attr; attr = TREE_CHAIN (attr))
+    {
+      tree name = get_attribute_name (attr);
+      if (TREE_CODE (t) == FUNCTION_TYPE)
+	{
+	  if (!attribute_writable_p (attr))
+	    return false;
+	}
+      else if (!aggregate
+	       || !(is_attribute_p ("packed", name)
+		    || is_attribute_p ("aligned", name)))
+	return false;
+    }
+  return true;
+}
+
+// Emit the attribute list LIST: the number of attributes, then for
+// each its name, the number of arguments, and each argument as a
+// byte saying what it is, followed by its value: 'i' an integer, 's'
+// a string, as a string table reference, or 'n' an identifier.
+// Attributes with other arguments are dropped.
+
 void
-hash_writer::write_void_type ()
+hash_writer::emit_attributes (tree list)
 {
-  emit ('V');
+  ssize_t count = 0;
+  for (tree attr = list; attr; attr = TREE_CHAIN (attr))
+    if (attribute_writable_p (attr))
+      ++count;
+  emit (count);
+
+  for (tree attr = list; attr; attr = TREE_CHAIN (attr))
+    {
+      if (!attribute_writable_p (attr))
+	continue;
+      emit_name (get_attribute_name (attr));
+      emit (static_cast<ssize_t> (list_length (TREE_VALUE (attr))));
+      for (tree args = TREE_VALUE (attr); args; args = TREE_CHAIN (args))
+	{
+	  tree arg = TREE_VALUE (args);
+	  if (TREE_CODE (arg) == INTEGER_CST)
+	    {
+	      emit ('i');
+	      emit (static_cast<ssize_t> (tree_to_shwi (arg)));
+	    }
+	  else if (TREE_CODE (arg) == STRING_CST)
+	    {
+	      const char *str = TREE_STRING_POINTER (arg);
+	      size_t len = TREE_STRING_LENGTH (arg) - 1;
+	      emit ('s');
+	      emit_uint (m_builder.intern (str, len,
+					   npch_hash_string (str, len)));
+	    }
+	  else
+	    {
+	      emit ('n');
+	      emit_name (arg);
+	    }
+	}
+    }
+}
+
+// The state of writing one function body.
+struct hash_writer::body_state
+{
+  tree fndecl;
+  // The index of each node written so far that may be shared.
+  std::unordered_map<tree, ssize_t> nodes;
+  // How deeply the item being written is nested.
+  unsigned depth;
+};
+
+// Encode the body of the function T and assign it an ID, much as get
+// does for a shareable type.  Returns -1 if the body uses something
+// that cannot be encoded, in which case only the declaration is
+// exported.
+
+ssize_t
+hash_writer::get_body (tree t)
+{
+  // A function that is still being encoded is assumed to work, so
+  // that recursive functions can be written.  Whatever refers to it
+  // then depends on it, though.
+  auto found = body_ids.find (t);
+  if (found != body_ids.end ())
+    {
+      auto open = open_bodies.find (t);
+      if (open != open_bodies.end () && (*open).second < m_body_low)
+	m_body_low = (*open).second;
+      return (*found).second;
+    }
+
+  size_t depth = ++m_body_depth;
+  size_t outer_low = m_body_low;
+  size_t first_held = held_bodies.size ();
+  body_ids[t] = NPCH_FIRST_RECORD;
+  open_bodies[t] = depth;
+  m_body_low = depth;
+
+  size_t start = m_offset;
+  body_state state;
+  state.fndecl = t;
+  state.depth = 0;
+  bool ok = write_body (state);
+  std::string contents (m_buffer + start, m_offset - start);
+  m_offset = start;
+
+  --m_body_depth;
+  size_t low = m_body_low;
+  m_body_low = low < depth && low < outer_low ? low : outer_low;
+
+  if (ok && low < depth)
+    {
+      // T is part of a cycle through a function that is still being
+      // encoded.  If that one fails, T would call a static function
+      // that has no body, so T is held back until it is done.  The
+      // failure reaches it through the callers in between.
+      open_bodies[t] = low;
+      held_bodies.push_back (std::make_pair (t, std::move (contents)));
+      return NPCH_FIRST_RECORD;
+    }
+
+  // T is done, and so is every body held back since it started, which
+  // can only depend on T or on functions it calls.  They stand or fall
+  // with it.
+  for (size_t i = first_held; i < held_bodies.size (); ++i)
+    {
+      tree held = held_bodies[i].first;
+      open_bodies.erase (held);
+      if (ok)
+	add_body (held, std::move (held_bodies[i].second));
+      else
+	body_ids[held] = -1;
+    }
+  held_bodies.resize (first_held);
+  open_bodies.erase (t);
+  if (!ok)
+    {
+      body_ids[t] = -1;
+      return -1;
+    }
+  return add_body (t, std::move (contents));
+}
+
+// Assign an ID to the body CONTENTS of the function T, and queue it to
+// be written.
+
+ssize_t
+hash_writer::add_body (tree t, std::string contents)
+{
+  bodies.push_back (std::move (contents));
+  ssize_t id = NPCH_FIRST_RECORD + record_offsets.size ();
+  body_ids[t] = id;
+  objects[DECL_SAVED_TREE (t)] = id;
+  record_offsets.push_back (0);
+  pending.push_back (std::make_pair (DECL_SAVED_TREE (t), &bodies.back ()));
+  return id;
+}
+
+// A body record is the GENERIC tree that the C front end leaves in
+// DECL_SAVED_TREE, which the middle end gimplifies as usual once the
+// reader hands it over.  This is much simpler than streaming GIMPLE
+// the way LTO does, and it keeps the body lazy: nothing needs to be
+// set up until the function is actually used.
+//
+// The record is a 'B'; a flags integer, which has bit 0 set if the
+// function is public, bit 1 if it is external and bit 2 if it was
+// declared inline; the RESULT_DECL; the number of parameters; each
+// PARM_DECL; and the body.  Each of these is a node, which is one of:
+//
+//   'N'				no tree
+//   'x' index				a node seen before
+//   'G' name				a global, found by name
+//   'F' ref, index			a field of a struct or union
+//   'I' ref, value			an integer constant
+//   'R' ref, name			a real constant, in hex
+//   'T' ref, length, bytes		a string constant
+//   'D' code, flags, name, ref, node	a local declaration and its
+//					initializer
+//   'L' count, nodes			a statement list
+//   'E' code, flags, [ref], count, nodes
+//					an expression and its operands
+//   'b' flags, [ref], count, nodes, node
+//					a BIND_EXPR, its variables and
+//					its body
+//
+// where a ref is the type of the node; it is only there for 'E' and
+// 'b' when the flags include NPCH_NODE_HAS_TYPE.  Nodes that the
+// reader builds, other than constants, are numbered in order from
+// zero, so that a tree used twice, such as a SAVE_EXPR, is still
+// shared.  The operand count of a CALL_EXPR leaves out its length,
+// which is operand zero.
+
+bool
+hash_writer::write_body (body_state &state)
+{
+  tree fndecl = state.fndecl;
+  ssize_t flags = ((TREE_PUBLIC (fndecl) ? 1 : 0)
+		   | (DECL_EXTERNAL (fndecl) ? 2 : 0)
+		   | (DECL_DECLARED_INLINE_P (fndecl) ? 4 : 0));
+  emit ('B');
+  emit (flags);
+  if (!write_item (state, DECL_RESULT (fndecl)))
+    return false;
+
+  emit (static_cast<ssize_t> (list_length (DECL_ARGUMENTS (fndecl))));
+  for (tree parm = DECL_ARGUMENTS (fndecl); parm; parm = DECL_CHAIN (parm))
+    if (!write_item (state, parm))
+      return false;
+
+  return write_item (state, DECL_SAVED_TREE (fndecl));
+}
+
+// Return the npch_node_flag bits for T.
+
+static ssize_t
+node_flags (tree t)
+{
+  ssize_t flags = 0;
+  if (TREE_TYPE (t) != NULL_TREE)
+    flags |= NPCH_NODE_HAS_TYPE;
+  if (TREE_SIDE_EFFECTS (t))
+    flags |= NPCH_NODE_SIDE_EFFECTS;
+  if (TREE_THIS_VOLATILE (t))
+    flags |= NPCH_NODE_VOLATILE;
+  if (TREE_READONLY (t))
+    flags |= NPCH_NODE_READONLY;
+  if (TREE_CONSTANT (t))
+    flags |= NPCH_NODE_CONSTANT;
+  if (TREE_ADDRESSABLE (t))
+    flags |= NPCH_NODE_ADDRESSABLE;
+  if (TREE_USED (t))
+    flags |= NPCH_NODE_USED;
+  if (TREE_NO_WARNING (t))
+    flags |= NPCH_NODE_NO_WARNING;
+  if (DECL_P (t))
+    {
+      if (DECL_ARTIFICIAL (t))
+	flags |= NPCH_NODE_ARTIFICIAL;
+      if (DECL_IGNORED_P (t))
+	flags |= NPCH_NODE_IGNORED;
+      if ((TREE_CODE (t) == VAR_DECL || TREE_CODE (t) == PARM_DECL)
+	  && DECL_REGISTER (t))
+	flags |= NPCH_NODE_REGISTER;
+    }
+  return flags;
+}
+
+// Write the node T of a body; see write_body.  Returns false if T
+// cannot be encoded.
+
+bool
+hash_writer::write_item (body_state &state, tree t)
+{
+  // Readers reject anything deeper.
+  if (state.depth >= NPCH_MAX_ITEM_DEPTH)
+    return false;
+  nesting level (state.depth);
+
+  if (t == NULL_TREE)
+    {
+      emit ('N');
+      return true;
+    }
+
+  auto found = state.nodes.find (t);
+  if (found != state.nodes.end ())
+    {
+      emit ('x');
+      emit ((*found).second);
+      return true;
+    }
+
+  // A variably modified type would be written as an incomplete
+  // array, which is not good enough for code.
+  tree type = TREE_TYPE (t);
+  if (type != NULL_TREE && TREE_CODE (t) != FIELD_DECL
+      && (variably_modified_type_p (type, NULL_TREE) || !can_write (type)))
+    return false;
+
+  switch (TREE_CODE (t))
+    {
+    case INTEGER_CST:
+      if (TYPE_PRECISION (type) > 64)
+	return false;
+      emit ('I');
+      emit_ref (type);
+      emit_uint (TREE_INT_CST_LOW (t));
+      return true;
+
+    case REAL_CST:
+      {
+	const REAL_VALUE_TYPE *value = TREE_REAL_CST_PTR (t);
+	if (real_isinf (value) || real_isnan (value))
+	  return false;
+	char buf[64];
+	real_to_hexadecimal (buf, value, sizeof (buf), 0, 1);
+	size_t len = strlen (buf);
+	emit ('R');
+	emit_ref (type);
+	emit_uint (m_builder.intern (buf, len, npch_hash_string (buf, len)));
+	return true;
+      }
+
+    case STRING_CST:
+      emit ('T');
+      emit_ref (type);
+      emit (static_cast<ssize_t> (TREE_STRING_LENGTH (t)));
+      emit (TREE_STRING_POINTER (t), TREE_STRING_LENGTH (t));
+      return true;
+
+    case FIELD_DECL:
+      {
+	tree context = DECL_CONTEXT (t);
+	ssize_t index = 0;
+	for (tree iter = TYPE_FIELDS (context); iter != t;
+	     iter = DECL_CHAIN (iter))
+	  ++index;
+	emit ('F');
+	emit_ref (context);
+	emit (index);
+	return true;
+      }
+
+    case FUNCTION_DECL:
+    case VAR_DECL:
+      // A global has to be found by name, since the reader binds it
+      // like any other declaration.  A static variable, or a static
+      // function without a body, would turn into a reference to an
+      // external symbol that does not exist.
+      if (DECL_EXTERNAL (t) || DECL_FILE_SCOPE_P (t))
+	{
+	  if (DECL_NAME (t) == NULL_TREE
+	      || !global_bound_p (t)
+	      || (!TREE_PUBLIC (t)
+		  && (TREE_CODE (t) != FUNCTION_DECL || !inline_body_p (t)
+		      || get_body (t) < 0)))
+	    return false;
+	  emit ('G');
+	  emit_name (DECL_NAME (t));
+	  return true;
+	}
+      if (TREE_CODE (t) == FUNCTION_DECL || TREE_STATIC (t))
+	return false;
+      /* Fall through.  */
+    case PARM_DECL:
+    case RESULT_DECL:
+    case LABEL_DECL:
+    case TYPE_DECL:
+      {
+	if (DECL_CONTEXT (t) != state.fndecl)
+	  return false;
+	state.nodes.emplace (t, state.nodes.size ());
+	emit ('D');
+	emit (static_cast<ssize_t> (TREE_CODE (t)));
+	emit (node_flags (t));
+	emit_name (DECL_NAME (t));
+	emit_ref (type);
+	emit_location (DECL_SOURCE_LOCATION (t));
+	// The initializer of a label only says that it is defined.
+	return write_item (state, (TREE_CODE (t) == VAR_DECL
+				   ? DECL_INITIAL (t) : NULL_TREE));
+      }
+
+    case STATEMENT_LIST:
+      {
+	state.nodes.emplace (t, state.nodes.size ());
+	tree_stmt_iterator i;
+	ssize_t count = 0;
+	for (i = tsi_start (t); !tsi_end_p (i); tsi_next (&i))
+	  ++count;
+	emit ('L');
+	emit (count);
+	for (i = tsi_start (t); !tsi_end_p (i); tsi_next (&i))
+	  if (!write_item (state, tsi_stmt (i)))
+	    return false;
+	return true;
+      }
+
+    case BIND_EXPR:
+      {
+	// The reader builds a BLOCK for each BIND_EXPR, so the BLOCK
+	// itself is not written.
+	state.nodes.emplace (t, state.nodes.size ());
+	ssize_t flags = node_flags (t);
+	emit ('b');
+	emit (flags);
+	if ((flags & NPCH_NODE_HAS_TYPE) != 0)
+	  emit_ref (type);
+	ssize_t count = 0;
+	for (tree var = BIND_EXPR_VARS (t); var; var = DECL_CHAIN (var))
+	  ++count;
+	emit (count);
+	// The reader chains the variables together again, so each must
+	// be a new local.
+	for (tree var = BIND_EXPR_VARS (t); var; var = DECL_CHAIN (var))
+	  if (TREE_CODE (var) == FUNCTION_DECL || DECL_EXTERNAL (var)
+	      || state.nodes.count (var) != 0 || !write_item (state, var))
+	    return false;
+	return write_item (state, BIND_EXPR_BODY (t));
+      }
+
+    default:
+      break;
+    }
+
+  enum tree_code_class cls = TREE_CODE_CLASS (TREE_CODE (t));
+  switch (cls)
+    {
+    case tcc_expression:
+    case tcc_unary:
+    case tcc_binary:
+    case tcc_comparison:
+    case tcc_reference:
+    case tcc_statement:
+    case tcc_vl_exp:
+      break;
+    default:
+      return false;
+    }
+
+  state.nodes.emplace (t, state.nodes.size ());
+  ssize_t flags = node_flags (t);
+  int first = cls == tcc_vl_exp ? 1 : 0;
+  int n_ops = TREE_OPERAND_LENGTH (t);
+  emit ('E');
+  emit (static_cast<ssize_t> (TREE_CODE (t)));
+  emit (flags);
+  if ((flags & NPCH_NODE_HAS_TYPE) != 0)
+    emit_ref (type);
+  emit (static_cast<ssize_t> (n_ops - first));
+  for (int i = first; i < n_ops; ++i)
+    if (!write_item (state, TREE_OPERAND (t, i)))
+      return false;
+  return true;
+}
+
+// A macro record is an 'M', a byte that has bit 0 set for a
+// function-like macro and bit 1 for a variadic one, the number of
+// parameters, the name of each, and the number of tokens in the
+// expansion.  Then, for each token, its cpp_ttype as a byte; a byte
+// saying what operand it has: 'n' an identifier, 's' the spelling of
+// a literal, 'a' a parameter number, or '-' none; its flags; and its
+// operand.  Keeping tokens rather than text means the reader need
+// not run the lexer.
+
+void
+hash_writer::write_macro (cpp_hashnode *node)
+{
+  const cpp_macro *macro = node->value.macro;
+  emit ('M');
+  emit (char ((macro->fun_like ? 1 : 0) | (macro->variadic ? 2 : 0)));
+  emit_location (macro->line);
+  emit (static_cast<ssize_t> (macro->paramc));
+  for (unsigned i = 0; i < macro->paramc; ++i)
+    emit_name (HT_IDENT_TO_GCC_IDENT (HT_NODE (macro->params[i])));
+
+  emit (static_cast<ssize_t> (macro->count));
+  for (unsigned i = 0; i < macro->count; ++i)
+    {
+      const cpp_token &token = macro->exp.tokens[i];
+      char kind;
+      switch (cpp_token_val_index (&token))
+	{
+	case CPP_TOKEN_FLD_NODE:
+	  kind = 'n';
+	  break;
+	case CPP_TOKEN_FLD_STR:
+	  kind = 's';
+	  break;
+	case CPP_TOKEN_FLD_ARG_NO:
+	  kind = 'a';
+	  break;
+	default:
+	  kind = '-';
+	  break;
+	}
+
+      emit (char (token.type));
+      emit (kind);
+      emit (static_cast<ssize_t> (token.flags));
+      if (kind == 'n')
+	emit_name (HT_IDENT_TO_GCC_IDENT (HT_NODE (token.val.node.node)));
+      else if (kind == 's')
+	{
+	  const char *text = (const char *) token.val.str.text;
+	  size_t len = token.val.str.len;
+	  emit_uint (m_builder.intern (text, len,
+				       npch_hash_string (text, len)));
+	}
+      else if (kind == 'a')
+	emit (static_cast<ssize_t> (token.val.macro_arg.arg_no));
+    }
 }
 
 void
@@ -307,9 +1132,12 @@ hash_writer::write (tree t)
       return write_function_type (t);
     case ARRAY_TYPE:
       return write_array_type (t);
+    case VECTOR_TYPE:
+      return write_vector_type (t);
+    case COMPLEX_TYPE:
+      return write_complex_type (t);
     case ENUMERAL_TYPE:
       return write_enum_type (t);
-    // FIXME bitfield
     case UNION_TYPE:
     case RECORD_TYPE:
       return write_struct_or_union_type (t);
@@ -319,24 +1147,197 @@ hash_writer::write (tree t)
     case TYPE_DECL:
       return write_decl (t);
 
-    case VOID_TYPE:
-      return write_void_type ();
+    default:
+      // can_write keeps these out, except when it was optimistic
+      // about a cycle of aggregates.  The reader will refuse the
+      // record, and so anything that depends on it.
+      emit ('?');
+      break;
+    }
+}
+
+// True if T is identified by the contents of its record, so that it
+// can share a record with any structurally identical type.  Decls,
+// and the aggregates they name, have an identity of their own.
 
+static bool
+shareable_p (tree t)
+{
+  if (!TYPE_P (t))
+    return false;
+  if (TYPE_QUALS (t))
+    return true;
+  switch (TREE_CODE (t))
+    {
+    case RECORD_TYPE:
+    case UNION_TYPE:
+    case ENUMERAL_TYPE:
+      return false;
     default:
-      fprintf (stderr, "[tree code %d]\n", int (TREE_CODE (t)));
-      abort ();
+      return true;
     }
 }
 
+// True if an importer can find the global declaration T by name: it
+// is a builtin, it came from a file that binds it, or this file will
+// bind it.  A body must not name anything else, such as a function
+// declared in a header the export filter leaves out.
+
+bool
+hash_writer::global_bound_p (tree t)
+{
+  npch_origin origin;
+  return (DECL_SOURCE_LOCATION (t) <= BUILTINS_LOCATION
+	  || imported_p (t, &origin)
+	  || (file_scope_p (t) && exported_p (declared_at (t))
+	      && can_write (t)));
+}
+
+// True if T was imported and should be referred to, rather than
+// copied; shareable types are cheap enough to copy.  Set *ORIGIN to
+// where it came from.
+
+bool
+hash_writer::imported_p (tree t, npch_origin *origin)
+{
+  return !shareable_p (t) && m_find_origin && m_find_origin (t, origin);
+}
+
+// True if T, and every type it refers to, can be written.  A
+// declaration that cannot be is skipped, rather than exported wrong.
+
+bool
+hash_writer::can_write (tree t)
+{
+  if (builtin_type_id (t) >= 0)
+    return true;
+  auto found = writable.find (t);
+  if (found != writable.end ())
+    return (*found).second;
+
+  // Assume the best while looking, so that a struct that points to
+  // itself terminates.  What was imported is written as a reference.
+  writable[t] = true;
+  npch_origin origin;
+  if (imported_p (t, &origin))
+    return true;
+  bool ok = false;
+  if (TYPE_P (t) && !type_attributes_written_p (t))
+    ok = false;
+  else if (TYPE_P (t) && TYPE_QUALS (t))
+    ok = can_write (build_qualified_type (t, 0));
+  else
+    switch (TREE_CODE (t))
+      {
+      case INTEGER_TYPE:
+      case REAL_TYPE:
+      case ENUMERAL_TYPE:
+	ok = true;
+	break;
+
+      case POINTER_TYPE:
+      case ARRAY_TYPE:
+      case COMPLEX_TYPE:
+	ok = can_write (TREE_TYPE (t));
+	break;
+
+      case VECTOR_TYPE:
+	ok = (!TYPE_VECTOR_OPAQUE (t)
+	      && (INTEGRAL_TYPE_P (TREE_TYPE (t))
+		  || SCALAR_FLOAT_TYPE_P (TREE_TYPE (t)))
+	      && can_write (TREE_TYPE (t)));
+	break;
+
+      case FUNCTION_TYPE:
+	ok = can_write (TREE_TYPE (t));
+	for (tree iter = TYPE_ARG_TYPES (t); ok && iter;
+	     iter = TREE_CHAIN (iter))
+	  if (iter != void_list_node)
+	    ok = can_write (TREE_VALUE (iter));
+	break;
+
+      case RECORD_TYPE:
+      case UNION_TYPE:
+	ok = (TYPE_SIZE (t) == NULL_TREE
+	      || TREE_CODE (TYPE_SIZE (t)) == INTEGER_CST);
+	for (tree iter = TYPE_FIELDS (t); ok && iter; iter = DECL_CHAIN (iter))
+	  {
+	    tree type = DECL_BIT_FIELD_TYPE (iter);
+	    ok = (TREE_CODE (iter) == FIELD_DECL
+		  && can_write (type != NULL_TREE ? type : TREE_TYPE (iter)));
+	  }
+	break;
+
+      case FUNCTION_DECL:
+      case VAR_DECL:
+      case TYPE_DECL:
+	ok = can_write (TREE_TYPE (t));
+	break;
+
+      default:
+	break;
+      }
+
+  writable[t] = ok;
+  return ok;
+}
+
 ssize_t
 hash_writer::get (tree t)
 {
   auto ptr = objects.find (t);
   if (ptr != objects.end ())
     return (*ptr).second;
-  objects[t] = here ();
-  write (t);
-  return objects[t];
+
+  int builtin = builtin_type_id (t);
+  if (builtin >= 0)
+    return builtin;
+
+  // A shareable type is encoded right away, using the end of the
+  // pool as scratch space, and its encoding is the key under which
+  // records are shared.  This recurses into the types it refers to,
+  // but never through an aggregate, so it terminates.  Sharing the
+  // ID, rather than only the bytes, also means the reader builds
+  // each distinct type once.  Anything else that was imported is
+  // encoded as an 'X' reference to its base, and shared the same
+  // way.
+  const std::string *contents = nullptr;
+  npch_origin origin;
+  bool external = imported_p (t, &origin);
+  if (external || shareable_p (t))
+    {
+      size_t start = m_offset;
+      if (external)
+	{
+	  emit ('X');
+	  emit_uint (m_builder.add_base (origin.file, origin.checksum));
+	  emit_uint (origin.record);
+	}
+      else
+	write (t);
+      std::string key (m_buffer + start, m_offset - start);
+      m_offset = start;
+
+      auto found = shared.find (key);
+      if (found != shared.end ())
+	{
+	  objects[t] = (*found).second;
+	  return (*found).second;
+	}
+      auto inserted = shared.emplace (std::move (key),
+				      NPCH_FIRST_RECORD
+				      + record_offsets.size ());
+      contents = &(*inserted.first).first;
+    }
+
+  // Just assign an ID here; the record itself is written later by
+  // finish.  This way a record is always emitted in one piece, and
+  // references to records that are not written yet need no patching.
+  ssize_t id = NPCH_FIRST_RECORD + record_offsets.size ();
+  objects[t] = id;
+  record_offsets.push_back (0);
+  pending.push_back (std::make_pair (t, contents));
+  return id;
 }
 
 void
@@ -345,32 +1346,51 @@ hash_writer::emit (char c)
   emit (&c, 1);
 }
 
-void
-hash_writer::emit (const char *s)
+// Return the string table offset of the identifier NAME, adding it
+// if needed.  A null NAME is the empty string at offset zero.
+
+uint32_t
+hash_writer::intern (tree name)
 {
-  emit (s, strlen (s) + 1);
+  if (name == NULL_TREE)
+    return 0;
+
+  auto iter = string_offsets.find (name);
+  if (iter != string_offsets.end ())
+    return (*iter).second;
+
+  uint32_t result = m_builder.intern (IDENTIFIER_POINTER (name),
+				      IDENTIFIER_LENGTH (name),
+				      IDENTIFIER_HASH_VALUE (name));
+  string_offsets[name] = result;
+  return result;
 }
 
 void
-hash_writer::emit (ssize_t val)
+hash_writer::emit_name (tree name)
 {
-  ensure (4);
-  emit_at (here (), val);
-  m_offset += 4;
+  emit_uint (intern (name));
 }
 
 void
-hash_writer::emit_at (size_t offset, ssize_t val)
+hash_writer::emit_ref (tree t)
 {
-  char buf[4];
+  emit_uint (get (t));
+}
 
-  for (int i = 0; i < 4; ++i)
-    {
-      buf[i] = val & 0xff;
-      val >>= 8;
-    }
+void
+hash_writer::emit (ssize_t val)
+{
+  emit_uint (npch_zigzag (val));
+}
 
-  memcpy (m_buffer + offset, buf, 4);
+void
+hash_writer::emit_uint (uint64_t val)
+{
+  ensure (NPCH_MAX_VARINT);
+  m_offset += npch_encode_uint (reinterpret_cast<uint8_t *> (m_buffer
+							    + m_offset),
+				val);
 }
 
 void
@@ -386,7 +1406,7 @@ hash_writer::ensure (size_t len)
 {
   if (m_offset + len >= m_len)
     {
-      m_len *= 2;
+      m_len = m_len ? 2 * m_len : 4096;
       if (m_offset + len >= m_len)
 	m_len = m_offset + len;
       m_buffer = static_cast<char *> (xrealloc (m_buffer, m_len));
@@ -7,17 +7,43 @@
 #include "tree.h"
 #include <stdlib.h>
 #include <list>
+#include <deque>
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <functional>
 #include "ggc.h"
 #include <assert.h>
+#include "builder.hh"
+
+struct cpp_hashnode;
+
+// Where a tree read from an imported .npch file came from: the
+// absolute path and checksum of that file, and the record's ID in it.
+struct npch_origin
+{
+  std::string file;
+  uint64_t checksum;
+  uint64_t record;
+};
+
+// Return true and fill in the origin if the tree was imported.
+typedef std::function<bool (tree, npch_origin *)> npch_origin_function;
 
 class hash_writer
 {
 public:
 
-  hash_writer (const char *, const char *);
+  // Write to FILENAME when compilation finishes.  COMPRESSION is the
+  // zlib level used for the constant pool, or -1 to leave the pool
+  // uncompressed.  If EXPORTS is not empty, only names declared in
+  // files that one of its patterns matches are exported; see
+  // exported_p.  FIND_ORIGIN says which trees were imported; the
+  // output refers to their records rather than copying them, and
+  // so is layered on the files they came from.
+  hash_writer (const char *plugin_name, const char *filename,
+	       int compression, const std::vector<std::string> &exports,
+	       npch_origin_function find_origin);
 
   ~hash_writer ()
   {
@@ -28,6 +54,11 @@ private:
   void add (tree);
   static void exported_add (void *, void *);
 
+  void add_include (const char *);
+  static void exported_add_include (void *, void *);
+  void add_dependency (const char *);
+  bool exported_p (location_t);
+
   void mark ();
   static void exported_mark (void *, void *);
 
@@ -39,16 +70,27 @@ private:
   void write_float_type (tree);
   void write_pointer_type (tree);
   void write_qualified_type (tree);
-  void write_bitfield_type (tree);
   void write_array_type (tree);
+  void write_vector_type (tree);
+  void write_complex_type (tree);
   void write_enum_type (tree);
   void write_function_type (tree);
   void write_struct_or_union_type (tree);
-  void write_void_type ();
   void write_decl (tree);
+  struct body_state;
+  ssize_t get_body (tree);
+  ssize_t add_body (tree, std::string);
+  bool write_body (body_state &);
+  bool write_item (body_state &, tree);
+  void write_macro (cpp_hashnode *);
   void write (tree);
+  bool imported_p (tree, npch_origin *);
+  bool global_bound_p (tree);
+  bool can_write (tree);
   ssize_t get (tree);
 
+  uint32_t intern (tree);
+
   size_t here ()
   {
     return m_offset;
@@ -56,18 +98,66 @@ private:
 
   // FIXME - error handling.
   void emit (char);
+  // Emit a signed or unsigned integer; see format.hh.
   void emit (ssize_t);
-  void emit (const char *);
+  void emit_uint (uint64_t);
   void emit (const char *, size_t);
-  void emit_at (size_t, ssize_t);
+  // Emit a reference to the string table entry for an identifier.
+  void emit_name (tree);
+  // Emit a reference to the record for a tree.
+  void emit_ref (tree);
+  void emit_attributes (tree);
+  void emit_location (location_t);
   void ensure (size_t);
 
-  void do_fwrite (FILE *, ssize_t);
-  void do_fwrite (FILE *, const char *, size_t);
 
   std::string m_filename;
+  int m_compression;
+  npch_origin_function m_find_origin;
+
+  // Every file read while parsing, for the manifest.
+  std::vector<std::string> includes;
+
+  // The export patterns, each also made absolute if it was relative.
+  std::vector<std::string> export_patterns;
+  // Whether names declared in each file are exported, keyed by the
+  // file name as the line maps hold it.
+  std::unordered_map<const char *, bool> exported_files;
   std::list<tree> inputs;
+
+  // Map each tree we have seen to its record ID.
   std::unordered_map<tree, ssize_t> objects;
+  // The pool offset of each record, indexed by ID less
+  // NPCH_FIRST_RECORD.
+  std::vector<size_t> record_offsets;
+  // Trees that have an ID but have not been written yet, each with
+  // its encoded record if it is shareable.
+  std::deque<std::pair<tree, const std::string *>> pending;
+  // Whether each tree can_write has looked at can be written.
+  std::unordered_map<tree, bool> writable;
+  // The ID of each distinct shareable record, keyed by its encoding.
+  std::unordered_map<std::string, ssize_t> shared;
+  // The encoded body of each inline function that has one.
+  std::list<std::string> bodies;
+  // The ID of the body record of each inline function, or -1 if its
+  // body cannot be encoded.
+  std::unordered_map<tree, ssize_t> body_ids;
+  // The functions whose bodies are being encoded, each with its depth
+  // in get_body, and those whose bodies are held back until a cycle
+  // they are part of is done, each with the least depth they depend
+  // on.
+  std::unordered_map<tree, size_t> open_bodies;
+  // The held back bodies, in the order they were encoded.
+  std::vector<std::pair<tree, std::string>> held_bodies;
+  // The depth of get_body, and the least depth of an open body that
+  // the body being encoded refers to.
+  size_t m_body_depth;
+  size_t m_body_low;
+
+  // Assembles the output file.
+  npch_builder m_builder;
+  // The string table reference of each identifier.
+  std::unordered_map<tree, uint32_t> string_offsets;
 
   char *m_buffer;
   size_t m_offset;